@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+"""Measures how the compile time of the plugin grows with the reflected code.
+
+Synthetic translation units are generated over a grid of sizes: N classes with
+M members, K overloads of each function and T tags per member, and enums with
+up to 10k enumerators. Each of them is compiled with and without the plugin,
+both times with -ftime-trace, and the frontend, plugin and recompile time and
+the peak memory are reported. Each compilation runs --repeat times and the
+fastest run is taken, so a busy machine doesn't inflate the ratios. With
+--max-overhead the script fails when the plugin makes any compilation slower
+than the given factor.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import time
+from pathlib import Path
+
+GRIDS = {
+    # (name, classes, members, overloads, tags, enumerators[, extra flags])
+    "small": [
+        ("classes-10x4", 10, 4, 1, 0, 0),
+        ("classes-100x4", 100, 4, 1, 0, 0),
+        ("classes-100x16", 100, 16, 1, 0, 0),
+        ("overloads-50x4x4", 50, 4, 4, 0, 0),
+        ("tags-50x4-t2", 50, 4, 1, 2, 0),
+        ("enum-1000", 0, 0, 0, 0, 1000),
+    ],
+    "full": [
+        ("classes-10x4", 10, 4, 1, 0, 0),
+        ("classes-100x4", 100, 4, 1, 0, 0),
+        ("classes-500x4", 500, 4, 1, 0, 0),
+        ("classes-100x16", 100, 16, 1, 0, 0),
+        ("classes-100x64", 100, 64, 1, 0, 0),
+        ("overloads-100x4x4", 100, 4, 4, 0, 0),
+        ("overloads-100x4x16", 100, 4, 16, 0, 0),
+        ("tags-100x8-t1", 100, 8, 1, 1, 0),
+        ("tags-100x8-t4", 100, 8, 1, 4, 0),
+        ("enum-100", 0, 0, 0, 0, 100),
+        ("enum-1000", 0, 0, 0, 0, 1000),
+        ("enum-10000", 0, 0, 0, 0, 10000),
+        ("lists-100x64x4-type_list", 100, 64, 4, 1, 0),
+        ("lists-100x64x4-std_tuple", 100, 64, 4, 1, 0, ["-DREFL_TUPLE=std::tuple"]),
+    ],
+    # the metadata lists as refl::type_list and as std::tuple
+    "lists": [
+        ("lists-100x16x4-type_list", 100, 16, 4, 1, 0),
+        ("lists-100x16x4-std_tuple", 100, 16, 4, 1, 0, ["-DREFL_TUPLE=std::tuple"]),
+        ("lists-100x64x4-type_list", 100, 64, 4, 1, 0),
+        ("lists-100x64x4-std_tuple", 100, 64, 4, 1, 0, ["-DREFL_TUPLE=std::tuple"]),
+    ],
+}
+
+
+def generate(classes, members, overloads, tags, enumerators):
+    out = ["#include <refl/refl.hpp>", "#include <cstddef>", ""]
+    for t in range(tags):
+        out.append(f"struct Tag{t} {{}};")
+    out.append("")
+    for c in range(classes):
+        out.append(f"struct [[refl::all]] C{c} {{")
+        for m in range(members):
+            attrs = "".join(f"__attribute__((refl_tag(Tag{t}{{}}))) " for t in range(tags))
+            out.append(f"    {attrs}int m{m};")
+        for k in range(overloads):
+            params = ", ".join(["int"] * k)
+            out.append(f"    int f({params}) {{ return {k}; }}")
+        out.append("};")
+    for c in range(1 if enumerators else 0):
+        out.append(f"enum class [[refl::all]] E{c} {{")
+        out.append(",\n".join(f"    e{e}" for e in range(enumerators)))
+        out.append("};")
+    out.append("")
+    # instantiate the metadata, as real uses would
+    out.append("std::size_t use() {")
+    out.append("    std::size_t n = 0;")
+    for c in range(classes):
+        out.append(f"    refl::with<C{c}>([&]<class M>() {{ refl::for_each_variable<M>([&]<class V>() {{ n += V::name.size(); }}); }});")
+    if enumerators:
+        out.append(f"    n += refl::e::to_string(E0::e{enumerators - 1}).size();")
+    out.append("    return n;")
+    out.append("}")
+    return "\n".join(out) + "\n"
+
+
+def run(cmd, repeat):
+    """Returns the lowest wall time and the highest peak memory of repeat runs."""
+    wall, rss = float("inf"), 0.0
+    for _ in range(repeat):
+        start = time.perf_counter()
+        proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        output = proc.stdout.read()
+        _, status, usage = os.wait4(proc.pid, 0)
+        elapsed = time.perf_counter() - start
+        if os.waitstatus_to_exitcode(status) != 0:
+            sys.exit(f"compilation failed: {' '.join(cmd)}\n{output.decode(errors='replace')}")
+        wall = min(wall, elapsed)
+        # ru_maxrss is in kilobytes on Linux
+        rss = max(rss, usage.ru_maxrss / 1024)
+    return wall, rss
+
+
+def phases(trace_file):
+    """Splits a -ftime-trace of a plugin compilation into its phases, in seconds.
+
+    The first Frontend event is the original parse. The plugin marks its own
+    phases with 'refl ...' sections, the recompilation of the rewritten files
+    is the 'refl recompile' one.
+    """
+    events = json.loads(Path(trace_file).read_text())["traceEvents"]
+    complete = [e for e in events if e.get("ph") == "X"]
+
+    def total(name):
+        return sum(e["dur"] for e in complete if e["name"] == name)
+
+    frontends = sorted((e for e in complete if e["name"] == "Frontend"), key=lambda e: e["ts"])
+    if not frontends:
+        return None
+    frontend = frontends[0]["dur"]
+    plugin = total("refl traversal") + total("refl rewrite") + total("refl write")
+    recompile = total("refl recompile")
+    return frontend / 1e6, plugin / 1e6, recompile / 1e6
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--compiler", required=True)
+    parser.add_argument("--plugin", required=True)
+    parser.add_argument("--include", required=True, help="the include directory of refl")
+    parser.add_argument("--out", required=True, help="directory of the generated sources and traces")
+    parser.add_argument("--grid", choices=GRIDS.keys(), default="small")
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="compile each case this many times and take the fastest run")
+    parser.add_argument("--max-overhead", type=float,
+                        help="fail when compiling with the plugin is slower than this factor")
+    parser.add_argument("--json", help="also write the results to this file")
+    args = parser.parse_args()
+    if args.repeat < 1:
+        parser.error("--repeat must be at least 1")
+
+    out = Path(args.out)
+    out.mkdir(parents=True, exist_ok=True)
+    common = [args.compiler, "-std=c++23", "-O0", "-c", f"-I{args.include}", "-Wno-unknown-attributes"]
+
+    results = []
+    print(f"{'case':<26}{'base[s]':>9}{'refl[s]':>9}{'ratio':>7}{'front[s]':>10}"
+          f"{'plugin[s]':>11}{'recomp[s]':>11}{'base[MB]':>10}{'refl[MB]':>10}")
+    for name, classes, members, overloads, tags, enumerators, *flags in GRIDS[args.grid]:
+        flags = flags[0] if flags else []
+        source = out / f"{name}.cpp"
+        source.write_text(generate(classes, members, overloads, tags, enumerators))
+
+        base_wall, base_rss = run(common + flags + ["-ftime-trace", str(source), "-o", str(out / f"{name}.base.o")], args.repeat)
+        trace = out / f"{name}.refl.json"
+        refl_wall, refl_rss = run(common + flags + [f"-fplugin={args.plugin}", f"-ftime-trace={trace}",
+                                            str(source),
+                                            "-o", str(out / f"{name}.refl.o")], args.repeat)
+        split = phases(trace) if trace.exists() else None
+        frontend, plugin, recompile = split if split else (float("nan"),) * 3
+        ratio = refl_wall / base_wall
+        results.append({"case": name, "base": base_wall, "refl": refl_wall, "ratio": ratio,
+                        "frontend": frontend, "plugin": plugin, "recompile": recompile,
+                        "base_rss_mb": base_rss, "refl_rss_mb": refl_rss})
+        print(f"{name:<26}{base_wall:>9.2f}{refl_wall:>9.2f}{ratio:>7.2f}{frontend:>10.2f}"
+              f"{plugin:>11.2f}{recompile:>11.2f}{base_rss:>10.0f}{refl_rss:>10.0f}")
+
+    if args.json:
+        Path(args.json).write_text(json.dumps(results, indent=2))
+
+    if args.max_overhead:
+        slow = [r for r in results if r["ratio"] > args.max_overhead]
+        for r in slow:
+            print(f"{r['case']}: the plugin overhead {r['ratio']:.2f}x exceeds {args.max_overhead:.2f}x",
+                  file=sys.stderr)
+        if slow:
+            return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
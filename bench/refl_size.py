@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+"""Reports how much the reflection metadata adds to a shared library.
+
+The translation units of refl_bench.py are compiled with -g into shared
+libraries without the plugin, with it, and with its 'nodebug' and 'hidden'
+arguments. The size of the code, data and debug sections and the number of
+exported symbols are printed for each of them.
+
+The names of a record are one string literal, which the linker merges across
+translation units when the compiler puts it in a mergeable string section
+(SHF_MERGE and SHF_STRINGS, the 'M' and 'S' flags of readelf). The section
+holding the names of the first class is printed with its flags for each object
+file, and the script fails when it is not such a section.
+"""
+
+import argparse
+import json
+import subprocess
+import sys
+from pathlib import Path
+
+from refl_bench import generate
+
+CASES = [
+    # (name, classes, members, overloads, tags, enumerators)
+    ("classes-100x16", 100, 16, 1, 0, 0),
+    ("overloads-100x4x4", 100, 4, 4, 0, 0),
+    ("tags-100x8-t2", 100, 8, 1, 2, 0),
+    ("enum-1000", 0, 0, 0, 0, 1000),
+]
+
+SECTIONS = [".text", ".rodata", ".data.rel.ro", ".dynsym", ".dynstr", ".debug_info", ".debug_str"]
+
+
+def variants(plugin):
+    return {
+        "base": [],
+        "refl": [f"-fplugin={plugin}"],
+        "refl-nodebug-hidden": [f"-fplugin={plugin}", "-fplugin-arg-reflect-nodebug", "-fplugin-arg-reflect-hidden",
+                                "-DREFL_NODEBUG", "-DREFL_HIDDEN"],
+    }
+
+
+def check_output(cmd):
+    proc = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+    if proc.returncode != 0:
+        sys.exit(f"command failed: {' '.join(cmd)}\n{proc.stdout}")
+    return proc.stdout
+
+
+def sections(size, library):
+    # 'size -A' prints one 'name size address' line per section
+    result = {}
+    for line in check_output([size, "-A", str(library)]).splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[0].startswith(".") and fields[1].isdigit():
+            result[fields[0]] = int(fields[1])
+    return result
+
+
+def exported(nm, library):
+    return len(check_output([nm, "-D", "--defined-only", str(library)]).splitlines())
+
+
+def section_flags(readelf, obj):
+    # 'readelf -S -W' prints '[Nr] Name Type Address Off Size ES Flg Lk Inf Al',
+    # the flags are the only column that is not a number after the entry size
+    result = {}
+    for line in check_output([readelf, "-S", "-W", str(obj)]).splitlines():
+        fields = line.replace("[ ", "[").split()
+        if len(fields) < 8 or not fields[0].startswith("[") or not fields[1].startswith("."):
+            continue
+        flags = fields[7]
+        result[fields[1]] = "" if flags.isdigit() else flags
+    return result
+
+
+def names_section(readelf, obj, sections, marker):
+    # the first section whose string dump holds the marker
+    for name in sections:
+        if marker in check_output([readelf, "-W", "-p", name, str(obj)]):
+            return name
+    return None
+
+
+# the names of the first class are used at runtime, so the literal is emitted
+USE_NAME = """
+const char* refl_size_name() {
+    const char* name = nullptr;
+    refl::with<C0>([&]<class M>() { name = M::name.data(); });
+    return name;
+}
+"""
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--compiler", required=True)
+    parser.add_argument("--plugin", required=True)
+    parser.add_argument("--include", required=True, help="the include directory of refl")
+    parser.add_argument("--out", required=True, help="directory of the generated sources and libraries")
+    parser.add_argument("--size", default="size")
+    parser.add_argument("--nm", default="nm")
+    parser.add_argument("--readelf", default="readelf")
+    parser.add_argument("--json", help="also write the results to this file")
+    args = parser.parse_args()
+
+    out = Path(args.out)
+    out.mkdir(parents=True, exist_ok=True)
+    common = [args.compiler, "-std=c++23", "-O1", "-g", "-fPIC", "-shared", f"-I{args.include}",
+              "-Wno-unknown-attributes"]
+
+    results = []
+    unmerged = []
+    print(f"{'case':<22}{'variant':<22}" + "".join(f"{s:>14}" for s in SECTIONS) + f"{'exported':>10}  names")
+    for name, classes, members, overloads, tags, enumerators in CASES:
+        source = out / f"{name}.cpp"
+        source.write_text(generate(classes, members, overloads, tags, enumerators) + (USE_NAME if classes else ""))
+        for variant, flags in variants(args.plugin).items():
+            library = out / f"lib{name}.{variant}.so"
+            check_output(common + flags + [str(source), "-o", str(library)])
+            sizes = sections(args.size, library)
+            symbols = exported(args.nm, library)
+            result = {"case": name, "variant": variant, "sections": sizes, "exported": symbols}
+
+            # the linker combines the sections, their flags are those of the object files
+            names = ""
+            if classes and flags:
+                obj = out / f"{name}.{variant}.o"
+                check_output([f for f in common if f != "-shared"] + flags + ["-c", str(source), "-o", str(obj)])
+                all_flags = section_flags(args.readelf, obj)
+                # the pool starts with the name of the class and the one of its first member
+                section = names_section(args.readelf, obj, [s for s in all_flags if "S" in all_flags[s]], "C0m0")
+                result["names_section"] = {"name": section, "flags": all_flags.get(section, "")}
+                names = f"{section} ({all_flags.get(section, '')})" if section else "not in a string section"
+                if not section or "M" not in all_flags[section]:
+                    unmerged.append(f"{name} {variant}")
+            results.append(result)
+            print(f"{name:<22}{variant:<22}" + "".join(f"{sizes.get(s, 0):>14}" for s in SECTIONS)
+                  + f"{symbols:>10}  {names}")
+
+    if args.json:
+        Path(args.json).write_text(json.dumps(results, indent=2))
+    if unmerged:
+        sys.exit("the names are not in a mergeable string section: " + ", ".join(unmerged))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -87,8 +87,8 @@ struct Serializer<T> {
         if (in.back() != '}') throw "} missing";
         if (in.size() == 2) return;
 
-        // first collect each name-value pair
-        std::map<std::string_view, std::string_view> members;
+        // first collect each name-value pair, keyed by the hash of the name
+        std::map<std::uint64_t, std::string_view> members;
 
         const char* begin = &in.front();
         const char* end   = &in.back();
@@ -113,13 +113,13 @@ struct Serializer<T> {
                 }
                 back++;
                 auto value = in.substr(static_cast<size_t>(front - begin), static_cast<size_t>(back - front));
-                members.insert(std::make_pair(name, value));
+                members.insert(std::make_pair(refl::hash_name(name), value));
             } else {
                 while (*back != ',' && *back != '}') {
                     back++;
                 }
                 auto value = in.substr(static_cast<size_t>(front - begin), static_cast<size_t>(back - front));
-                members.insert(std::make_pair(name, value));
+                members.insert(std::make_pair(refl::hash_name(name), value));
             }
             if (*back == ',') back++;
             front = back;
@@ -130,7 +130,8 @@ struct Serializer<T> {
                 if constexpr (V::is_instance() && !refl::has_tag<V, skip_ser>) {
                     // for each variable we know its type and member pointer here
                     // so we just need to find the corresponding part of the input
-                    auto found = members.find(V::name);
+                    // the hash of the member name is a compile time constant
+                    auto found = members.find(V::name_hash);
                     if (found != members.end()) {
                         auto& d = data.*V::ptr;
                         Serializer<std::decay_t<decltype(d)>>::deserialize(d, found->second);
@@ -38,6 +38,8 @@ struct [[refl::all]] Example {
     }
     Inner data;
     std::vector<Inner> moreData;
+    // bit-fields are read and written through the generated accessors
+    unsigned version : 4 = 2;
 };
 
 // to differentiate between those types that can be directly printed by our
@@ -90,7 +92,7 @@ struct Serializer<T> {
                 if constexpr (V::is_instance() && !refl::has_tag<V, skip_ser>) {
                     if (f++) os << ",";
                     os << std::format("{}:", V::name);
-                    const auto& d = data.*V::ptr;
+                    const auto& d = V::get(data);
                     // recursive call to Serializer to handle the data
                     // (either: basic_type, std::vector or any reflected type)
                     Serializer<std::decay_t<decltype(d)>>::serialize(d, os);
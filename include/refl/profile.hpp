@@ -0,0 +1,267 @@
+#pragma once
+#include <refl/refl.hpp>
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace refl {
+
+// Tag of the functions whose calls through refl::instrumented are counted
+// and timed:
+//   __attribute__((refl_tag(refl::profile{}))) void update();
+// The statistics of every thread are merged by snapshot() and dump().
+struct profile {
+    // the latencies are counted in buckets by their bit width in
+    // nanoseconds, bucket i holds those in [2^(i-1), 2^i) ns
+    static constexpr std::size_t buckets = 40;
+
+    struct result {
+        std::string name;
+        std::uint64_t count = 0;
+        std::chrono::nanoseconds total{};
+        std::array<std::uint64_t, buckets> histogram{};
+
+        // the upper bound of the bucket holding the given fraction of the calls
+        std::chrono::nanoseconds percentile(double fraction) const
+        {
+            auto rank = static_cast<std::uint64_t>(fraction * static_cast<double>(count));
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i != buckets; ++i) {
+                seen += histogram[i];
+                if (seen > rank || seen == count)
+                    return std::chrono::nanoseconds{std::int64_t{1} << i};
+            }
+            return std::chrono::nanoseconds{std::int64_t{1} << (buckets - 1)};
+        }
+    };
+
+    // the statistics of every profiled function called so far
+    static std::vector<result> snapshot();
+    static void dump(std::FILE* out = stderr);
+};
+
+namespace detail {
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+
+// The statistics of one function in one thread. Only the thread owning them
+// writes them, relaxed stores are enough for snapshot() to read them.
+struct profile_counters {
+    std::atomic<std::uint64_t> count{0};
+    std::atomic<std::uint64_t> total{0};
+    std::array<std::atomic<std::uint64_t>, profile::buckets> histogram{};
+
+    void add(std::atomic<std::uint64_t>& counter, std::uint64_t value) noexcept
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    void record(std::uint64_t ns) noexcept
+    {
+        add(count, 1);
+        add(total, ns);
+        add(histogram[std::min(static_cast<std::size_t>(std::bit_width(ns)), profile::buckets - 1)], 1);
+    }
+};
+
+#pragma clang diagnostic pop
+
+// The counters of a thread, allocated a chunk at a time on the first call of
+// the functions numbered by the chunk, so they never move while being read.
+class profile_buffer {
+public:
+    static constexpr std::size_t chunk_size = 64;
+    static constexpr std::size_t max_functions = chunk_size * 64;
+
+    profile_buffer() = default;
+    profile_buffer(const profile_buffer&) = delete;
+    profile_buffer& operator=(const profile_buffer&) = delete;
+
+    ~profile_buffer()
+    {
+        for (auto& chunk : chunks_) delete[] chunk.load(std::memory_order_relaxed);
+    }
+
+    // nullptr beyond max_functions
+    profile_counters* at(std::size_t id)
+    {
+        if (id >= max_functions)
+            return nullptr;
+        auto& slot  = chunks_[id / chunk_size];
+        auto* chunk = slot.load(std::memory_order_relaxed);
+        if (!chunk) {
+            chunk = new profile_counters[chunk_size];
+            slot.store(chunk, std::memory_order_release);
+        }
+        return &chunk[id % chunk_size];
+    }
+
+    const profile_counters* find(std::size_t id) const
+    {
+        const auto* chunk = chunks_[id / chunk_size].load(std::memory_order_acquire);
+        return chunk ? &chunk[id % chunk_size] : nullptr;
+    }
+
+private:
+    std::array<std::atomic<profile_counters*>, max_functions / chunk_size> chunks_{};
+};
+
+// The names of the profiled functions, numbered by their first call, and the
+// buffers of the threads. The buffer of a finished thread is kept with its
+// counters and handed to the next new thread. It is never destroyed, the
+// threads still running at exit release their buffers after the statics.
+class profile_registry {
+public:
+    static profile_registry& get()
+    {
+        static auto* registry = new profile_registry;
+        return *registry;
+    }
+
+    std::size_t add(std::string name)
+    {
+        std::lock_guard lock{mutex_};
+        names_.push_back(std::move(name));
+        return names_.size() - 1;
+    }
+
+    profile_buffer* acquire()
+    {
+        std::lock_guard lock{mutex_};
+        if (!free_.empty()) {
+            auto* buffer = free_.back();
+            free_.pop_back();
+            return buffer;
+        }
+        return buffers_.emplace_back(std::make_unique<profile_buffer>()).get();
+    }
+
+    void release(profile_buffer* buffer)
+    {
+        std::lock_guard lock{mutex_};
+        free_.push_back(buffer);
+    }
+
+    std::vector<profile::result> snapshot()
+    {
+        std::lock_guard lock{mutex_};
+        std::vector<profile::result> results(names_.size());
+        for (std::size_t id = 0; id != names_.size(); ++id) {
+            auto& result = results[id];
+            result.name  = names_[id];
+            for (const auto& buffer : buffers_) {
+                const auto* counters = id < profile_buffer::max_functions ? buffer->find(id) : nullptr;
+                if (!counters)
+                    continue;
+                result.count += counters->count.load(std::memory_order_relaxed);
+                result.total += std::chrono::nanoseconds{counters->total.load(std::memory_order_relaxed)};
+                for (std::size_t i = 0; i != profile::buckets; ++i)
+                    result.histogram[i] += counters->histogram[i].load(std::memory_order_relaxed);
+            }
+        }
+        return results;
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<std::string> names_;
+    std::vector<std::unique_ptr<profile_buffer>> buffers_;
+    std::vector<profile_buffer*> free_;
+};
+
+inline profile_buffer& thread_profile_buffer()
+{
+    struct slot {
+        profile_buffer* buffer = profile_registry::get().acquire();
+        ~slot() { profile_registry::get().release(buffer); }
+    };
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wexit-time-destructors"
+    // the destructor returns the buffer when the thread ends
+    thread_local slot local;
+#pragma clang diagnostic pop
+    return *local.buffer;
+}
+
+// records the time until the end of the scope, also when it is left by an exception
+class profile_scope {
+public:
+    explicit profile_scope(std::size_t id) noexcept
+        : id_(id)
+        , start_(std::chrono::steady_clock::now())
+    {
+    }
+    profile_scope(const profile_scope&) = delete;
+    profile_scope& operator=(const profile_scope&) = delete;
+
+    ~profile_scope()
+    {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+        if (auto* counters = thread_profile_buffer().at(id_))
+            counters->record(static_cast<std::uint64_t>(ns));
+    }
+
+private:
+    std::size_t id_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// the qualified name of the function with its parameters, as overloads are
+// profiled one by one
+template <typename F>
+std::string profile_name()
+{
+    return std::string{F::qualified_name} + std::string{F::full_name.substr(F::name.size())};
+}
+
+} // namespace detail
+
+inline std::vector<profile::result> profile::snapshot()
+{
+    return detail::profile_registry::get().snapshot();
+}
+
+inline void profile::dump(std::FILE* out)
+{
+    std::fprintf(out, "%-48s %12s %14s %12s %12s %12s\n", "function", "calls", "total[us]", "mean[ns]", "p50[ns]", "p99[ns]");
+    for (const auto& result : snapshot()) {
+        if (result.count == 0)
+            continue;
+        auto total = static_cast<unsigned long long>(result.total.count());
+        std::fprintf(out, "%-48s %12llu %14llu %12llu %12llu %12llu\n", result.name.c_str(),
+                     static_cast<unsigned long long>(result.count), total / 1000, total / result.count,
+                     static_cast<unsigned long long>(result.percentile(0.5).count()),
+                     static_cast<unsigned long long>(result.percentile(0.99).count()));
+    }
+}
+
+// Calls the reflected function F. The calls of the functions tagged with
+// refl::profile are counted and timed in the buffer of the calling thread,
+// the others are called directly:
+//   refl::instrumented<F>{}(object, args...);
+template <typename F>
+struct instrumented {
+    template <typename... A>
+    decltype(auto) operator()(A&&... args) const
+    {
+        if constexpr (has_tag<F, profile>) {
+            static const std::size_t id = detail::profile_registry::get().add(detail::profile_name<F>());
+            detail::profile_scope scope{id};
+            return std::invoke(F::ptr, std::forward<A>(args)...);
+        } else {
+            return std::invoke(F::ptr, std::forward<A>(args)...);
+        }
+    }
+};
+
+} // namespace refl
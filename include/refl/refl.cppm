@@ -0,0 +1,26 @@
+// The refl module, importing it makes the same declarations available as
+// including refl.hpp. The declarations are attached to the global module, so
+// translation units can both import the module and include the header. The
+// std::tuple_size and std::tuple_element specializations of tuple.hpp are
+// not exported, they are reachable through refl::type_list.
+module;
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <concepts>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+export module refl;
+
+#define REFL_DETAIL_MODULE 1
+export extern "C++" {
+#include "refl.hpp"
+}
+
+extern "C++" {
+#include "tuple.hpp"
+}
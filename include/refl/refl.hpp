@@ -1,19 +1,84 @@
 #pragma once
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <concepts>
+#include <cstdint>
 #include <optional>
 #include <stdexcept>
 #include <string_view>
 #include <tuple>
 #include <type_traits>
 
-// std::get, std::tuple_size, std::tuple_element must be supported
+// the metadata lists must support std::tuple_size and std::tuple_element,
+// the tag tuples std::get as well
 #ifndef REFL_TUPLE
-    #define REFL_TUPLE std::tuple
+    #define REFL_TUPLE ::refl::type_list
+    #ifndef REFL_TAG_TUPLE
+        #define REFL_TAG_TUPLE std::tuple
+    #endif
+#endif
+#ifndef REFL_TAG_TUPLE
+    #define REFL_TAG_TUPLE REFL_TUPLE
+#endif
+
+// With REFL_NODEBUG the names and tags of the metadata are left out of the
+// debug info, with REFL_HIDDEN the metadata types get hidden visibility, so
+// shared libraries don't export them. The plugin arguments 'nodebug' and
+// 'hidden' do the same for the code it generates.
+#if defined(REFL_NODEBUG) && defined(__clang__)
+    #define REFL_DETAIL_NODEBUG [[gnu::nodebug]]
+#else
+    #define REFL_DETAIL_NODEBUG
+#endif
+#if defined(REFL_HIDDEN) && !defined(_WIN32)
+    #define REFL_DETAIL_HIDDEN [[gnu::visibility("hidden")]]
+#else
+    #define REFL_DETAIL_HIDDEN
 #endif
 
 namespace refl {
 
+// List of types without storage, the default for the metadata lists. Unlike
+// std::tuple it is never instantiated beyond its name, its elements are
+// reached by pack expansion or by __type_pack_element.
+template <typename... T> struct type_list {
+    static constexpr std::size_t size = sizeof...(T);
+};
+
+#if __has_builtin(__type_pack_element)
+template <std::size_t I, typename... T>
+using pack_element_t = __type_pack_element<I, T...>;
+#else
+template <std::size_t I, typename... T>
+using pack_element_t = std::tuple_element_t<I, std::tuple<T...>>;
+#endif
+
+template <std::size_t I, typename L> struct type_list_element;
+template <std::size_t I, typename... T> struct type_list_element<I, type_list<T...>> {
+    using type = pack_element_t<I, T...>;
+};
+template <std::size_t I, typename L>
+using type_list_element_t = typename type_list_element<I, L>::type;
+
+namespace detail {
+
+template <typename T, typename = std::make_index_sequence<std::tuple_size_v<T>>>
+struct tuple_to_type_list;
+template <typename T, std::size_t... I>
+struct tuple_to_type_list<T, std::index_sequence<I...>> {
+    using type = type_list<std::tuple_element_t<I, T>...>;
+};
+
+// any list supporting std::tuple_element as a type_list
+template <typename T> struct to_type_list : tuple_to_type_list<T> {};
+template <typename... T> struct to_type_list<type_list<T...>> {
+    using type = type_list<T...>;
+};
+template <typename T> using to_type_list_t = typename to_type_list<T>::type;
+
+} // namespace detail
+
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
 
@@ -44,11 +109,79 @@ template <typename B, AccessSpecifier I> struct Base {
     static constexpr AccessSpecifier access = I;
 };
 
-template <typename P, cxstring... Names> struct PList {
-    using types                                                           = P;
-    static constexpr std::array<std::string_view, sizeof...(Names)> names = {
-        std::string_view{Names}...
-    };
+namespace detail {
+
+// The names of a record and its members are generated as one string per
+// record, the 'value()' of the pool type given to the metadata. The members
+// refer to their names by offset and length, the qualified name of the
+// record is the first 'prefix' characters.
+struct string_pool {
+    std::string_view text;
+    std::size_t prefix;
+};
+
+template <typename Pool, std::size_t O, std::size_t L>
+REFL_DETAIL_HIDDEN REFL_DETAIL_NODEBUG inline constexpr std::string_view pooled = Pool::value().text.substr(O, L);
+
+// the qualified name of a member is the one of the record and its name
+template <typename Pool, std::size_t O, std::size_t L>
+REFL_DETAIL_HIDDEN REFL_DETAIL_NODEBUG inline constexpr auto qualified_storage = [] {
+    constexpr auto pool = Pool::value();
+    std::array<char, pool.prefix + 2 + L> s{};
+    auto it = std::copy_n(pool.text.begin(), pool.prefix, s.begin());
+    *it++   = ':';
+    *it++   = ':';
+    std::copy_n(pool.text.begin() + O, L, it);
+    return s;
+}();
+
+template <typename Pool, std::size_t O, std::size_t L>
+REFL_DETAIL_HIDDEN REFL_DETAIL_NODEBUG inline constexpr std::string_view qualified = {
+    qualified_storage<Pool, O, L>.data(), qualified_storage<Pool, O, L>.size()
+};
+
+// the parameter names are stored separated by commas
+template <std::size_t N>
+constexpr std::array<std::string_view, N> split_names(std::string_view names)
+{
+    std::array<std::string_view, N> result{};
+    for (std::size_t i = 0; i != N; ++i) {
+        auto end  = names.find(',');
+        result[i] = names.substr(0, end);
+        names.remove_prefix(end == std::string_view::npos ? names.size() : end + 1);
+    }
+    return result;
+}
+
+template <typename Pool, std::size_t O, std::size_t L, std::size_t N>
+struct REFL_DETAIL_HIDDEN param_names {
+    REFL_DETAIL_NODEBUG static constexpr auto value = split_names<N>(pooled<Pool, O, L>);
+};
+
+// pools of the records whose metadata is written to headers in emit mode
+template <typename T> struct pool;
+// and the accessors of their bit-fields, see BitVar
+template <typename T> struct bit_access;
+
+} // namespace detail
+
+// The 64-bit FNV-1a hash of a name: starting from 14695981039346656037 each
+// byte is xor-ed into the hash, which is then multiplied by 1099511628211.
+// It is the 'name_hash' of the metadata, stable across compilers and
+// platforms, so names read at runtime can be dispatched with a switch.
+constexpr std::uint64_t hash_name(std::string_view name) noexcept
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    for (char c : name) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+template <typename P, typename Names> struct REFL_DETAIL_HIDDEN PList {
+    using types                                            = P;
+    REFL_DETAIL_NODEBUG static constexpr const auto& names = Names::value;
 };
 
 #pragma clang diagnostic push
@@ -57,51 +190,189 @@ template <typename E>
 struct Enumerator {
     std::string_view name;
     E value;
+    std::uint64_t name_hash = hash_name(name);
 };
 #pragma clang diagnostic pop
 
 template <typename T, cxstring N, cxstring UN>
-struct EnumType {
-    static constexpr bool reflected                  = true;
-    using type                                       = T;
-    static constexpr std::string_view name           = N;
-    static constexpr std::string_view qualified_name = UN;
+struct REFL_DETAIL_HIDDEN EnumType {
+    static constexpr bool reflected                                      = true;
+    using type                                                           = T;
+    REFL_DETAIL_NODEBUG static constexpr std::string_view name           = N;
+    REFL_DETAIL_NODEBUG static constexpr std::string_view qualified_name = UN;
+    static constexpr std::uint64_t name_hash                             = hash_name(name);
     // std::array<Enumerator<T>, X> enumerators;
 };
 
-template <typename T, cxstring N, cxstring UN, typename B, typename F, typename V, typename C>
-struct RecordType {
-    static constexpr bool reflected                  = true;
-    using type                                       = T;
-    static constexpr std::string_view name           = N;
-    static constexpr std::string_view qualified_name = UN;
-    using base_classes                               = B;
-    using functions                                  = F;
-    using variables                                  = V;
-    using constructors                               = C;
+// a range of bytes of a record
+struct layout_run {
+    std::size_t offset;
+    std::size_t size;
+};
+
+// the offset of static variables and of the variables of class templates,
+// whose layout depends on the template arguments
+inline constexpr std::size_t no_offset = static_cast<std::size_t>(-1);
+
+// Tag of the variables written by more than one thread. The plugin warns when
+// they share a cache line with another variable of the record:
+//   __attribute__((refl_tag(refl::concurrent{}))) std::atomic<int> count;
+struct concurrent {};
+
+namespace detail {
+
+template <typename T> struct member_type;
+template <typename M, typename C> struct member_type<M C::*> {
+    using type = M;
+};
+template <typename M> struct member_type<M*> {
+    using type = M;
 };
+template <typename T> using member_type_t = typename member_type<T>::type;
 
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct field_layout {
+    std::size_t offset;
+    std::size_t size;
+    bool trivial;
+};
+#pragma clang diagnostic pop
+
+// the instance variables with a known offset, ordered by their offset
+template <typename... V>
+constexpr auto field_layouts(type_list<V...>)
+{
+    constexpr std::size_t count = (0 + ... + (V::is_instance() && V::offset != no_offset));
+    std::array<field_layout, count> result{};
+    std::size_t i = 0;
+    (
+        [&] {
+            if constexpr (V::is_instance() && V::offset != no_offset)
+                result[i++] = {V::offset, V::size, std::is_trivially_copyable_v<typename V::member_type>};
+        }(),
+        ...
+    );
+    std::sort(result.begin(), result.end(), [](const auto& a, const auto& b) { return a.offset < b.offset; });
+    return result;
+}
+
+// adjacent trivially copyable fields without padding between them form a
+// run, bit-fields sharing their bytes overlap
+template <std::size_t N>
+constexpr std::size_t count_runs(const std::array<field_layout, N>& fields)
+{
+    std::size_t count = 0, end = 0;
+    for (std::size_t i = 0; i != N; ++i) {
+        if (!fields[i].trivial)
+            continue;
+        if (count != 0 && fields[i - 1].trivial && end >= fields[i].offset) {
+            end = std::max(end, fields[i].offset + fields[i].size);
+        } else {
+            count++;
+            end = fields[i].offset + fields[i].size;
+        }
+    }
+    return count;
+}
+
+} // namespace detail
+
+// The metadata of records and their members is split in two. The Info part
+// holds what does not depend on the template arguments of a class template
+// (names, access, tags), it is shared by every instantiation. The types
+// deriving from it only add the types and pointers.
+
+// RELOCATABLE is set by the plugin when every base and instance variable is
+// reflected and the copy and move constructors and the destructor are not
+// user-provided, see is_trivially_relocatable
+template <typename Pool, std::size_t NO, std::size_t NL, bool RELOCATABLE = false>
+struct REFL_DETAIL_HIDDEN RecordInfo {
+    REFL_DETAIL_NODEBUG static constexpr std::string_view name           = detail::pooled<Pool, NO, NL>;
+    REFL_DETAIL_NODEBUG static constexpr std::string_view qualified_name = detail::pooled<Pool, 0, Pool::value().prefix>;
+    static constexpr std::uint64_t name_hash                             = hash_name(name);
+    static constexpr bool relocates_members                              = RELOCATABLE;
+};
+
+template <typename T, typename Info, typename B, typename F, typename V, typename C>
+struct REFL_DETAIL_HIDDEN RecordType : Info {
+    static constexpr bool reflected = true;
+    using info                      = Info;
+    using type                      = T;
+    using base_classes              = B;
+    using functions                 = F;
+    using variables                 = V;
+    using constructors              = C;
+
+    static constexpr std::size_t size      = sizeof(T);
+    static constexpr std::size_t alignment = alignof(T);
+
+    // the unused bytes between the reflected instance variables and after
+    // the last one, the padding of the record when every variable is reflected
+    static constexpr std::size_t padding()
+    {
+        constexpr auto fields = detail::field_layouts(detail::to_type_list_t<V>{});
+        std::size_t result = 0, end = 0;
+        for (std::size_t i = 0; i != fields.size(); ++i) {
+            end       = std::max(end, fields[i].offset + fields[i].size);
+            auto next = i + 1 != fields.size() ? fields[i + 1].offset : size;
+            result += next > end ? next - end : 0;
+        }
+        return result;
+    }
+
+    // the ranges of adjacent trivially copyable instance variables, each of
+    // them can be copied or compared with a single memcpy or memcmp
+    static constexpr auto trivially_copyable_runs()
+    {
+        constexpr auto fields = detail::field_layouts(detail::to_type_list_t<V>{});
+        std::array<layout_run, detail::count_runs(fields)> result{};
+        for (std::size_t i = 0, r = 0; i != fields.size(); ++i) {
+            if (!fields[i].trivial)
+                continue;
+            if (r != 0 && fields[i - 1].trivial && result[r - 1].offset + result[r - 1].size >= fields[i].offset)
+                result[r - 1].size = std::max(result[r - 1].size, fields[i].offset + fields[i].size - result[r - 1].offset);
+            else
+                result[r++] = {fields[i].offset, fields[i].size};
+        }
+        return result;
+    }
+};
+
+// the name is the beginning of the full name
 template <
-    auto P,
-    cxstring N,
-    cxstring UN,
-    cxstring ON,
+    typename Pool,
+    std::size_t NO,
+    std::size_t NL,
+    std::size_t FL,
     bool VIRT,
+    bool CONST,
+    bool CONSTEXPR,
     AccessSpecifier A,
-    typename R,
-    typename Params,
     auto... TAGS>
-struct Func {
-    using type                                       = decltype(P);
-    using return_type                                = R;
-    using parameters                                 = Params;
-    static constexpr auto ptr                        = P;
-    static constexpr auto access                     = A;
-    static constexpr std::string_view name           = N;
-    static constexpr std::string_view full_name      = ON;
-    static constexpr std::string_view qualified_name = UN;
-    static constexpr const bool is_virtual           = VIRT;
-    static constexpr REFL_TUPLE tags                 = {TAGS...};
+struct REFL_DETAIL_HIDDEN FuncInfo {
+    static constexpr auto access                                         = A;
+    REFL_DETAIL_NODEBUG static constexpr std::string_view name           = detail::pooled<Pool, NO, NL>;
+    REFL_DETAIL_NODEBUG static constexpr std::string_view full_name      = detail::pooled<Pool, NO, FL>;
+    REFL_DETAIL_NODEBUG static constexpr std::string_view qualified_name = detail::qualified<Pool, NO, NL>;
+    static constexpr std::uint64_t name_hash                             = hash_name(name);
+    static constexpr const bool is_virtual                               = VIRT;
+    static constexpr bool is_const                                       = CONST;
+    static constexpr bool is_constexpr                                   = CONSTEXPR;
+    REFL_DETAIL_NODEBUG static constexpr REFL_TAG_TUPLE tags             = {TAGS...};
+    using tag_types                                                      = type_list<std::remove_cv_t<decltype(TAGS)>...>;
+};
+
+// NOEXCEPT is left false by the plugin when the exception specification is
+// not known, for defaulted functions that were not used
+template <auto P, typename Info, typename R, typename Params, bool NOEXCEPT = false>
+struct REFL_DETAIL_HIDDEN Func : Info {
+    using info                        = Info;
+    using type                        = decltype(P);
+    using return_type                 = R;
+    using parameters                  = Params;
+    static constexpr auto ptr         = P;
+    static constexpr bool is_noexcept = NOEXCEPT;
 
     static constexpr bool is_instance()
     {
@@ -110,34 +381,96 @@ struct Func {
 };
 
 template <
-    auto P,
-    cxstring N,
-    cxstring UN,
+    typename Pool,
+    std::size_t NO,
+    std::size_t NL,
     bool MUT,
     AccessSpecifier A,
     auto... TAGS>
-struct Var {
-    using type                                       = decltype(P);
-    static constexpr auto ptr                        = P;
-    static constexpr auto access                     = A;
-    static constexpr std::string_view name           = N;
-    static constexpr std::string_view qualified_name = UN;
-    static constexpr bool is_mutable                 = MUT;
-    static constexpr REFL_TUPLE tags                 = {TAGS...};
+struct REFL_DETAIL_HIDDEN VarInfo {
+    static constexpr auto access                                         = A;
+    REFL_DETAIL_NODEBUG static constexpr std::string_view name           = detail::pooled<Pool, NO, NL>;
+    REFL_DETAIL_NODEBUG static constexpr std::string_view qualified_name = detail::qualified<Pool, NO, NL>;
+    static constexpr std::uint64_t name_hash                             = hash_name(name);
+    static constexpr bool is_mutable                                     = MUT;
+    REFL_DETAIL_NODEBUG static constexpr REFL_TAG_TUPLE tags             = {TAGS...};
+    using tag_types                                                      = type_list<std::remove_cv_t<decltype(TAGS)>...>;
+};
+
+// the offset is taken from the record layout by the plugin
+template <auto P, typename Info, std::size_t OFFSET = no_offset>
+struct REFL_DETAIL_HIDDEN Var : Info {
+    using info                             = Info;
+    using type                             = decltype(P);
+    using member_type                      = detail::member_type_t<type>;
+    static constexpr auto ptr              = P;
+    static constexpr std::size_t offset    = OFFSET;
+    static constexpr std::size_t size      = sizeof(member_type);
+    static constexpr std::size_t alignment = alignof(member_type);
+    static constexpr bool is_bit_field     = false;
 
     static constexpr bool is_instance()
     {
         return std::is_member_object_pointer_v<type>;
     }
+
+    // the same accessors as of bit-fields, for instance variables
+    template <typename C>
+    static constexpr const member_type& get(const C& obj)
+    {
+        return obj.*P;
+    }
+    template <typename C>
+    static constexpr void set(C& obj, const member_type& value)
+    {
+        obj.*P = value;
+    }
 };
 
-template <cxstring N, typename T, typename Params, auto... TAGS>
-struct Constr {
-    using type                             = T;
-    using parameters                       = Params;
-    using parameter_types                  = typename parameters::types;
-    static constexpr std::string_view name = N;
-    static constexpr REFL_TUPLE tags       = {TAGS...};
+// A member pointer can not point to a bit-field, the plugin generates the
+// accessors of the bit-field instead, as static functions of a struct next to
+// the metadata. The offset and the size are those of the bytes the bit-field
+// is stored in, the bit offset is counted from the beginning of the record.
+template <typename T, typename Info, auto GET, auto SET, std::size_t WIDTH, std::size_t BIT_OFFSET = no_offset>
+struct REFL_DETAIL_HIDDEN BitVar : Info {
+    using info                              = Info;
+    using class_type                        = T;
+    using member_type                       = decltype(GET(std::declval<const T&>()));
+    static constexpr std::size_t width      = WIDTH;
+    static constexpr std::size_t bit_offset = BIT_OFFSET;
+    static constexpr std::size_t offset     = BIT_OFFSET == no_offset ? no_offset : BIT_OFFSET / 8;
+    static constexpr std::size_t size       = ((BIT_OFFSET == no_offset ? 0 : BIT_OFFSET % 8) + WIDTH + 7) / 8;
+    static constexpr std::size_t alignment  = alignof(member_type);
+    static constexpr bool is_bit_field      = true;
+
+    static constexpr bool is_instance()
+    {
+        return true;
+    }
+
+    static constexpr member_type get(const T& obj)
+    {
+        return GET(obj);
+    }
+    static constexpr void set(T& obj, member_type value)
+    {
+        SET(obj, value);
+    }
+};
+
+template <typename Pool, std::size_t NO, std::size_t NL, auto... TAGS>
+struct REFL_DETAIL_HIDDEN ConstrInfo {
+    REFL_DETAIL_NODEBUG static constexpr std::string_view name = detail::pooled<Pool, NO, NL>;
+    REFL_DETAIL_NODEBUG static constexpr REFL_TAG_TUPLE tags   = {TAGS...};
+    using tag_types                                            = type_list<std::remove_cv_t<decltype(TAGS)>...>;
+};
+
+template <typename Info, typename T, typename Params>
+struct REFL_DETAIL_HIDDEN Constr : Info {
+    using info            = Info;
+    using type            = T;
+    using parameters      = Params;
+    using parameter_types = typename parameters::types;
 
     static constexpr bool is_default()
     {
@@ -156,6 +489,20 @@ struct Constr {
         return std::tuple_size<parameter_types>() == 1 &&
                std::is_same_v<T&&, std::tuple_element_t<0, parameter_types>>;
     }
+    static constexpr bool is_noexcept()
+    {
+        return []<typename... A>(type_list<A...>) {
+            return std::is_nothrow_constructible_v<T, A...>;
+        }(detail::to_type_list_t<parameter_types>{});
+    }
+    // only default, copy and move constructors can be trivial
+    static constexpr bool is_trivial()
+    {
+        if constexpr (is_default()) return std::is_trivially_default_constructible_v<T>;
+        else if constexpr (is_copy()) return std::is_trivially_copy_constructible_v<T>;
+        else if constexpr (is_move_copy()) return std::is_trivially_move_constructible_v<T>;
+        else return false;
+    }
 };
 
 template <typename T>
@@ -175,11 +522,48 @@ concept tagged_type = requires() {
     { T::tags };
 };
 
-template <typename T> struct meta {
+template <typename T> struct REFL_DETAIL_HIDDEN meta {
     static constexpr bool reflected = false;
 };
 
-template <has_reflection T> struct meta<T> : T::_meta {};
+template <has_reflection T> struct REFL_DETAIL_HIDDEN meta<T> : T::_meta {};
+
+// metadata declared next to the type by the plugin in inject mode
+template <typename T>
+concept has_injected_reflection = requires(T* p) {
+    { refl_meta(p) };
+};
+
+template <has_injected_reflection T>
+struct REFL_DETAIL_HIDDEN meta<T> : decltype(refl_meta(static_cast<T*>(nullptr))) {};
+
+namespace detail {
+
+template <typename T> inline constexpr bool always_false = false;
+
+// Stub put in place of the metadata in lazy mode when the reflection of the
+// type was not found to be used by the translation unit.
+template <typename T> struct lazy {
+    static_assert(always_false<T>, "refl: the metadata of this type was not generated, "
+                                   "its use was not found in lazy mode");
+};
+
+// Names used by the generated metadata. Macros and the std names are not
+// visible to the importers of the refl module, so the generated code only
+// refers to declarations of this namespace.
+template <typename... T> using list = REFL_TUPLE<T...>;
+template <typename T, std::size_t N> using array = std::array<T, N>;
+template <typename T> using optional = std::optional<T>;
+using string_view                 = std::string_view;
+inline constexpr std::nullopt_t nullopt = std::nullopt;
+
+[[noreturn]] inline void unreachable()
+{
+    assert(false);
+    __builtin_unreachable();
+}
+
+} // namespace detail
 
 template <typename... T>
 concept reflected = (... && meta<T>::reflected);
@@ -195,15 +579,9 @@ constexpr void with(C&& c)
 template <typename T, typename F>
 constexpr void for_each(F&& func)
 {
-    auto handler = []<typename T1, typename FUNC1, size_t... I>(
-                       FUNC1&& f, std::index_sequence<I...>
-                   ) {
-        (f.template operator()<std::tuple_element_t<I, T1>>(), ...);
-    };
-    handler.template operator()<T>(
-        std::forward<F>(func),
-        std::make_index_sequence<std::tuple_size<T>::value>{}
-    );
+    [&]<typename... E>(type_list<E...>) {
+        (func.template operator()<E>(), ...);
+    }(detail::to_type_list_t<T>{});
 }
 
 template <meta_type T, typename F>
@@ -260,15 +638,10 @@ constexpr void for_each_function(F&& func)
 template <typename T, typename F>
 constexpr void for_each_parameter(F&& func)
 {
-    auto handler = []<typename T1, typename FUNC1, size_t... I>(
-                       FUNC1&& f, std::index_sequence<I...>
-                   ) {
-        (f.template operator()<std::tuple_element_t<I, T1>, I>(T::parameters::names[I]), ...);
-    };
-    handler.template operator()<typename T::parameters::types>(
-        std::forward<F>(func),
-        std::make_index_sequence<std::tuple_size<typename T::parameters::types>::value>{}
-    );
+    using L = detail::to_type_list_t<typename T::parameters::types>;
+    [&]<size_t... I>(std::index_sequence<I...>) {
+        (func.template operator()<type_list_element_t<I, L>, I>(T::parameters::names[I]), ...);
+    }(std::make_index_sequence<L::size>{});
 }
 
 template <tagged_type T, typename TAG, typename F>
@@ -293,15 +666,11 @@ constexpr void with_tag(F&& func)
 
 namespace detail {
 
-template <tagged_type T, typename TAG> static inline constexpr bool has_tag()
+template <tagged_type T, typename TAG> inline constexpr bool has_tag()
 {
-    auto handler = []<typename T1, size_t... I>(const T1, std::index_sequence<I...>) {
-        return (... || std::is_same_v<TAG, std::tuple_element_t<I, T1>>);
-    };
-    return handler(
-        T::tags,
-        std::make_index_sequence<std::tuple_size_v<decltype(T::tags)>>{}
-    );
+    return []<typename... E>(type_list<E...>) {
+        return (... || std::is_same_v<TAG, E>);
+    }(typename T::tag_types{});
 }
 
 } // namespace detail
@@ -309,6 +678,152 @@ template <tagged_type T, typename TAG> static inline constexpr bool has_tag()
 template <typename T, typename TAG>
 concept has_tag = detail::has_tag<T, TAG>();
 
+// The classes of a closed hierarchy, the record marked with refl::closed and
+// the classes deriving from it, are numbered in preorder by the plugin: the
+// classes deriving from T have the ids (id, last]. The specialization of the
+// root lists every class of the hierarchy, ordered by id, as 'types'.
+// The primary template stands in for the specializations in the parse
+// generating them, and for the types of no closed hierarchy.
+template <typename T> struct hierarchy {
+    static constexpr bool generated = false;
+    using root                      = T;
+    using derived                   = detail::list<>;
+    using types                     = detail::list<T>;
+    static constexpr unsigned id = 0, last = 0;
+};
+
+template <typename T>
+concept closed = hierarchy<std::remove_cv_t<T>>::generated;
+
+namespace detail {
+
+// REFL_DETAIL_GENERATING is defined by the plugin in the parse generating the
+// metadata, the uses of closed hierarchies are compiled but not checked there
+#ifdef REFL_DETAIL_GENERATING
+inline constexpr bool generating = true;
+#else
+inline constexpr bool generating = false;
+#endif
+
+template <typename T>
+constexpr bool check_closed()
+{
+    static_assert(generating || closed<T>, "refl: the type is not part of a closed hierarchy");
+    return closed<T>;
+}
+
+template <typename Root> struct hierarchy_tag {};
+
+template <typename From, typename To>
+using copy_const_t = std::conditional_t<std::is_const_v<From>, const To, To>;
+
+template <typename R, typename B, typename F, typename D>
+R visit_as(B& obj, F& func)
+{
+    return func(static_cast<copy_const_t<B, D>&>(obj));
+}
+
+template <typename R, typename B, typename F, typename Types, std::size_t First, std::size_t... I>
+constexpr auto visit_table(std::index_sequence<I...>)
+{
+    return std::array<R (*)(B&, F&), sizeof...(I)>{&visit_as<R, B, F, type_list_element_t<First + I, Types>>...};
+}
+
+} // namespace detail
+
+// the id of the dynamic type of obj, returned by a virtual function the
+// plugin adds to every class of the hierarchy
+template <typename T>
+unsigned type_id(const T& obj) noexcept
+{
+    if constexpr (detail::check_closed<T>())
+        return obj._refl_type_id(detail::hierarchy_tag<typename hierarchy<std::remove_cv_t<T>>::root>{});
+    else
+        return 0;
+}
+
+// whether the dynamic type of obj is T or derives from it, without RTTI
+template <typename T, typename U>
+bool isa(const U& obj) noexcept
+{
+    using H = hierarchy<std::remove_cv_t<T>>;
+    if constexpr (detail::check_closed<T>() && detail::check_closed<U>()) {
+        static_assert(std::is_same_v<typename H::root, typename hierarchy<std::remove_cv_t<U>>::root>,
+                      "refl::isa: the types are not in the same closed hierarchy");
+        if constexpr (std::is_base_of_v<std::remove_cv_t<T>, std::remove_cv_t<U>>) return true;
+        else {
+            auto id = type_id(obj);
+            return H::id <= id && id <= H::last;
+        }
+    } else return false;
+}
+
+template <typename T, typename U>
+detail::copy_const_t<U, std::remove_cv_t<T>>* dyn_cast(U* ptr) noexcept
+{
+    return ptr && isa<T>(*ptr) ? static_cast<detail::copy_const_t<U, std::remove_cv_t<T>>*>(ptr) : nullptr;
+}
+
+// Calls func with obj cast to its dynamic type through a table indexed by
+// its id. The classes deriving from B are known, so func can call their
+// functions directly. func must return the same type for each of them.
+template <typename B, typename F>
+decltype(auto) visit_derived(B& obj, F&& func)
+{
+    using H     = hierarchy<std::remove_cv_t<B>>;
+    using Types = detail::to_type_list_t<typename hierarchy<typename H::root>::types>;
+    using R     = std::invoke_result_t<F&, B&>;
+    if constexpr (detail::check_closed<B>()) {
+        static constexpr auto table =
+            detail::visit_table<R, B, std::remove_reference_t<F>, Types, H::id>(std::make_index_sequence<H::last - H::id + 1>{});
+        return table[type_id(obj) - H::id](obj, func);
+    } else return func(obj);
+}
+
+// Whether a T can be moved to another address by copying its bytes and not
+// destroying the original: trivially copyable types, arrays of trivially
+// relocatable types, and reflected records whose bases and instance variables
+// are all trivially relocatable and which relocate them one by one, see
+// RecordInfo. It can be specialized for types that are not reflected.
+template <typename T> struct is_trivially_relocatable;
+
+namespace detail {
+
+template <typename V>
+constexpr bool relocatable_variable()
+{
+    if constexpr (V::is_instance()) return is_trivially_relocatable<typename V::member_type>::value;
+    else return true;
+}
+
+template <typename T>
+constexpr bool trivially_relocatable()
+{
+    if constexpr (std::is_trivially_copyable_v<T>) return true;
+    else if constexpr (std::is_array_v<T>) return is_trivially_relocatable<std::remove_all_extents_t<T>>::value;
+    else if constexpr (reflected<T>) {
+        using M = meta<T>;
+        if constexpr (!M::relocates_members || std::is_volatile_v<T>) return false;
+        else {
+            constexpr bool bases = []<typename... B>(type_list<B...>) {
+                return (true && ... && is_trivially_relocatable<typename B::type>::value);
+            }(to_type_list_t<typename M::base_classes>{});
+            constexpr bool variables = []<typename... V>(type_list<V...>) {
+                return (true && ... && relocatable_variable<V>());
+            }(to_type_list_t<typename M::variables>{});
+            return bases && variables;
+        }
+    } else return false;
+}
+
+} // namespace detail
+
+template <typename T>
+struct is_trivially_relocatable : std::bool_constant<detail::trivially_relocatable<T>()> {};
+
+template <typename T>
+inline constexpr bool is_trivially_relocatable_v = is_trivially_relocatable<T>::value;
+
 namespace e {
 namespace detail {
 
@@ -354,3 +869,8 @@ void for_each(F&& func)
 
 } // namespace refl
 
+// the module interface includes them outside of its export block
+#ifndef REFL_DETAIL_MODULE
+    #include "tuple.hpp"
+#endif
+
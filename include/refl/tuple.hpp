@@ -0,0 +1,14 @@
+// The specializations of the std templates for refl::type_list, included by
+// refl.hpp. Specializations of std templates can not be exported, the module
+// interface includes them after its export block.
+#pragma once
+#include "refl.hpp"
+
+// type_list keeps working with the code written for std::tuple
+template <typename... T>
+struct std::tuple_size<refl::type_list<T...>> : std::integral_constant<std::size_t, sizeof...(T)> {};
+
+template <std::size_t I, typename... T>
+struct std::tuple_element<I, refl::type_list<T...>> {
+    using type = refl::pack_element_t<I, T...>;
+};
@@ -53,7 +53,7 @@ public:
         if (Attr.getNumArgs() > 0) {
             unsigned ID = S.getDiagnostics().getCustomDiagID(
                 DiagnosticsEngine::Error,
-                "'refl::none/all' attributes do not accept arguments"
+                "'refl::none/all/data/closed' attributes do not accept arguments"
             );
             S.Diag(Attr.getLoc(), ID);
             return AttributeNotApplied;
@@ -111,6 +111,60 @@ public:
     }
 };
 
+// refl_only("functions,variables") reflects the record as refl::all, but
+// only the named member categories
+class ReflectCategoriesAttrInfo : public ParsedAttrInfo {
+public:
+    ReflectCategoriesAttrInfo()
+    {
+        static constexpr Spelling S[] = {
+            {ParsedAttr::AS_GNU, "refl_only"}
+        };
+        Spellings = S;
+        NumArgs   = 1;
+    }
+
+    bool diagAppertainsToDecl(Sema& S, const ParsedAttr& Attr, const Decl* D) const override
+    {
+        if (!isa<RecordDecl>(D)) {
+            S.Diag(Attr.getLoc(), diag::warn_attribute_wrong_decl_type)
+                << Attr << Attr.isRegularKeywordAttribute()
+                << ExpectedClass;
+            return false;
+        }
+        return true;
+    }
+
+    AttrHandling handleDeclAttribute(Sema& S, Decl* D, const ParsedAttr& Attr) const override
+    {
+        auto* List = Attr.getNumArgs() == 1 && Attr.isArgExpr(0) ? dyn_cast<StringLiteral>(Attr.getArgAsExpr(0)->IgnoreParenImpCasts()) : nullptr;
+        if (!List || !validCategories(List->getString())) {
+            unsigned ID = S.getDiagnostics().getCustomDiagID(
+                DiagnosticsEngine::Error,
+                "'refl_only' attribute expects a string listing bases, functions, variables or constructors"
+            );
+            S.Diag(Attr.getLoc(), ID);
+            return AttributeNotApplied;
+        }
+        Expr* Args[] = {List};
+        D->addAttr(AnnotateAttr::Create(S.Context, "refl_only", Args, 1, Attr.getRange(), AnnotateAttr::CXX11_clang_annotate));
+        return AttributeApplied;
+    }
+
+private:
+    static bool validCategories(StringRef Text)
+    {
+        SmallVector<StringRef, 4> Names;
+        Text.split(Names, ',', -1, false);
+        for (auto Name : Names) {
+            Name = Name.trim();
+            if (Name != "bases" && Name != "functions" && Name != "variables" && Name != "constructors")
+                return false;
+        }
+        return !Names.empty();
+    }
+};
+
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wglobal-constructors"
 
@@ -118,6 +172,12 @@ static clang::ParsedAttrInfoRegistry::Add<ReflectClassAttrInfo<"refl::none", "re
     Z1("reflect_attr_none", "create static reflection information");
 static clang::ParsedAttrInfoRegistry::Add<ReflectClassAttrInfo<"refl::all", "refl_all">>
     Z3("reflect_attr_all", "create static reflection information");
+static clang::ParsedAttrInfoRegistry::Add<ReflectClassAttrInfo<"refl::data", "refl_data">>
+    Z7("reflect_attr_data", "create static reflection information");
+static clang::ParsedAttrInfoRegistry::Add<ReflectCategoriesAttrInfo>
+    Z8("reflect_attr_only", "create static reflection information");
+static clang::ParsedAttrInfoRegistry::Add<ReflectClassAttrInfo<"refl::closed", "refl_closed">>
+    Z9("reflect_attr_closed", "create static reflection information");
 static clang::ParsedAttrInfoRegistry::Add<ReflectMemberAttrInfo<"refl::include", "refl_include", 0>>
     Z4("reflect_attr_include", "create static reflection information");
 static clang::ParsedAttrInfoRegistry::Add<ReflectMemberAttrInfo<"refl::exclude", "refl_exclude", 0>>
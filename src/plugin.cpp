@@ -4,15 +4,21 @@
 #include <clang/Basic/ParsedAttrInfo.h>
 #include <clang/Basic/Specifiers.h>
 #include <llvm/Support/raw_ostream.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <optional>
 #include <string>
 #include <vector>
 
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/ASTContext.h"
+#include "clang/AST/Attr.h"
 #include "clang/AST/Decl.h"
 #include "clang/AST/DeclCXX.h"
-#include "clang/ASTMatchers/ASTMatchFinder.h"
-#include "clang/ASTMatchers/ASTMatchers.h"
+#include "clang/AST/QualTypeNames.h"
+#include "clang/AST/RecordLayout.h"
+#include "clang/AST/RecursiveASTVisitor.h"
 #include "clang/Basic/Diagnostic.h"
 #include "clang/Basic/DiagnosticIDs.h"
 #include "clang/Basic/SourceLocation.h"
@@ -20,11 +26,24 @@
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/CompilerInvocation.h"
 #include "clang/Frontend/FrontendAction.h"
+#include "clang/Frontend/FrontendActions.h"
 #include "clang/Frontend/FrontendPluginRegistry.h"
+#include "clang/Frontend/MultiplexConsumer.h"
+#include "clang/Lex/Pragma.h"
+#include "clang/Lex/Preprocessor.h"
 #include "clang/Rewrite/Core/Rewriter.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/TargetParser/Triple.h"
 
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/CompilerInvocation.h"
@@ -34,8 +53,74 @@
 using namespace clang;
 using namespace llvm;
 
-template <typename IT>
-inline void compile(CompilerInstance* CI, std::string const& FileName, IT FileBegin, IT FileEnd)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wswitch-enum"
+
+// Creates the action requested on the command line. The plugin replaces the
+// main action of the compiler, so it has to run it on its own.
+static std::unique_ptr<FrontendAction> createProgramAction(frontend::ActionKind Kind)
+{
+    switch (Kind) {
+    case frontend::ParseSyntaxOnly:
+        return std::make_unique<SyntaxOnlyAction>();
+    case frontend::EmitAssembly:
+        return std::make_unique<EmitAssemblyAction>();
+    case frontend::EmitBC:
+        return std::make_unique<EmitBCAction>();
+    case frontend::EmitLLVM:
+        return std::make_unique<EmitLLVMAction>();
+    case frontend::EmitLLVMOnly:
+        return std::make_unique<EmitLLVMOnlyAction>();
+    case frontend::EmitCodeGenOnly:
+        return std::make_unique<EmitCodeGenOnlyAction>();
+    case frontend::GeneratePCH:
+        return std::make_unique<GeneratePCHAction>();
+    case frontend::GenerateModule:
+        return std::make_unique<GenerateModuleFromModuleMapAction>();
+    case frontend::GenerateModuleInterface:
+        return std::make_unique<GenerateModuleInterfaceAction>();
+    case frontend::GenerateReducedModuleInterface:
+        return std::make_unique<GenerateReducedModuleInterfaceAction>();
+    case frontend::GenerateHeaderUnit:
+        return std::make_unique<GenerateHeaderUnitAction>();
+    case frontend::EmitObj:
+    case frontend::PluginAction: // '-plugin reflect' leaves no other action to run
+        return std::make_unique<EmitObjAction>();
+    default:
+        return nullptr;
+    }
+}
+
+#pragma clang diagnostic pop
+
+// Returns the action of the original command line, the compiler instance
+// itself only knows about the plugin.
+static frontend::ActionKind getProgramAction(CompilerInstance const& CI)
+{
+    std::vector<const char*> args;
+    for (auto& it : CI.getCodeGenOpts().CommandLineArgs) {
+        args.push_back(it.c_str());
+    }
+
+    // the arguments were already checked once, their diagnostics are not repeated
+    DiagnosticsEngine Diagnostics{new DiagnosticIDs, new DiagnosticOptions, new IgnoringDiagConsumer};
+    CompilerInvocation Invocation;
+    CompilerInvocation::CreateFromArgs(Invocation, args, Diagnostics);
+    return Invocation.getFrontendOpts().ProgramAction;
+}
+
+static void reportUnsupportedAction(DiagnosticsEngine& Diagnostics)
+{
+    Diagnostics.Report(Diagnostics.getCustomDiagID(
+        DiagnosticsEngine::Error,
+        "refl: the frontend action requested on the command line is not supported"
+    ));
+}
+
+// rewritten contents of the changed files, keyed by the name they were opened with
+using RewrittenFiles = std::vector<std::pair<std::string, std::string>>;
+
+static void compile(CompilerInstance* CI, RewrittenFiles const& Files)
 {
     auto& Diagnostics{CI->getDiagnostics()};
     if (Diagnostics.getNumErrors() > 0)
@@ -63,19 +148,21 @@ inline void compile(CompilerInstance* CI, std::string const& FileName, IT FileBe
     CINew.setTarget(&Target);
     CINew.createDiagnostics(CI->getVirtualFileSystem());
 
-    // create rewrite buffer
-    std::string FileContent{FileBegin, FileEnd};
-    auto FileMemoryBuffer{MemoryBuffer::getMemBufferCopy(FileContent)};
-
-    // create "virtual" input file
+    // overlay every rewritten file, headers are picked up through the same
+    // include paths as in the original compilation
     auto& PreprocessorOpts{CINew.getPreprocessorOpts()};
-    PreprocessorOpts.addRemappedFile(FileName, FileMemoryBuffer.get());
-
-    // generate code
-    EmitObjAction EmitObj;
-    CINew.ExecuteAction(EmitObj);
+    for (auto& [FileName, FileContent] : Files) {
+        // owned by the source manager of the new instance
+        PreprocessorOpts.addRemappedFile(FileName, MemoryBuffer::getMemBufferCopy(FileContent, FileName).release());
+    }
 
-    auto _ = FileMemoryBuffer.release(); // intentionally not freed
+    // run the requested action on the rewritten file
+    auto Action{createProgramAction(CInvNew->getFrontendOpts().ProgramAction)};
+    if (!Action) {
+        reportUnsupportedAction(Diagnostics);
+        return;
+    }
+    CINew.ExecuteAction(*Action);
 }
 
 enum class ReflSpec { all,
@@ -85,70 +172,116 @@ enum class ReflSpec { all,
                       tag,
                       unknown };
 
-static ReflSpec getReflSpec(const Decl* decl, const SourceManager& SourceManager, ASTContext& Context_)
-{
-    const auto& attrs = decl->getAttrs();
-    for (auto a : attrs) {
-        if (!strcmp(a->getSpelling(), "annotate")) {
-            auto s = static_cast<std::string_view>(Lexer::getSourceText(
-                CharSourceRange::getTokenRange(a->getRange()), SourceManager,
-                Context_.getLangOpts()
-            ));
-            if (s.starts_with("refl_"))
-                return ReflSpec::tag;
-            if (s.starts_with("refl::")) {
-                if (s.ends_with("all"))
-                    return ReflSpec::all;
-                else if (s.ends_with("none"))
-                    return ReflSpec::none;
-                else if (s.ends_with("include"))
-                    return ReflSpec::include;
-                else if (s.ends_with("exclude"))
-                    return ReflSpec::exclude;
-            }
-        }
-    }
-    return ReflSpec::unknown;
-}
+// the member categories of a record that get metadata
+enum ReflCategory : unsigned {
+    ReflBases         = 1u << 0,
+    ReflFunctions     = 1u << 1,
+    ReflVariables     = 1u << 2,
+    ReflConstructors  = 1u << 3,
+    ReflAllCategories = ReflBases | ReflFunctions | ReflVariables | ReflConstructors,
+};
 
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wweak-vtables"
-#pragma clang diagnostic ignored "-Wunused-parameter"
-
-AST_MATCHER_P(Decl, hasReflectAttr, const char*, AttrName)
-{
-    auto Policy = PrintingPolicy{LangOptions{}};
-    for (const auto* Attr : Node.attrs()) {
-        std::string attr_name(Attr->getSpelling());
-        std::string attr_annotate("annotate");
-        std::string attr_my(AttrName);
-        if (attr_name == attr_annotate) {
-            std::string SS;
-            raw_string_ostream S(SS);
-            Attr->printPretty(S, Policy);
-            std::string attr_string(S.str());
-            if (attr_string.find(attr_my) != std::string::npos) {
-                return true;
-            }
-        }
+// parses a comma separated list of category names, as given to the
+// 'categories=' plugin argument and the refl_only attribute
+static std::optional<unsigned> parseCategories(StringRef List)
+{
+    unsigned Categories = 0;
+    SmallVector<StringRef, 4> Names;
+    List.split(Names, ',', -1, false);
+    for (auto Name : Names) {
+        auto Category = StringSwitch<unsigned>(Name.trim())
+                            .Case("bases", ReflBases)
+                            .Case("functions", ReflFunctions)
+                            .Case("variables", ReflVariables)
+                            .Case("constructors", ReflConstructors)
+                            .Default(0);
+        if (!Category)
+            return std::nullopt;
+        Categories |= Category;
     }
-    return false;
+    return Categories;
 }
 
-AST_MATCHER_P(VarDecl, isStaticFieldOf, const RecordDecl*, Record)
+// The attributes of src/attribute.cpp are stored as annotate attributes, they
+// are told apart by their annotation without looking at the source text. The
+// generation asks for those of every member several times, so the annotations
+// of a declaration are classified once per translation unit.
+class ReflAttrs {
+public:
+    ReflSpec spec(const Decl* decl) { return classify(decl).Spec; }
+
+    // refl::data reflects the bases and the variables, refl_only the categories
+    // it names, refl::all and refl::none the project defaults
+    unsigned categories(const Decl* decl, unsigned Default) { return classify(decl).Categories.value_or(Default); }
+
+    // whether the record is the root of a closed hierarchy
+    bool closed(const Decl* decl) { return classify(decl).Closed; }
+
+    // whether the field is tagged with refl::concurrent
+    bool concurrent(const Decl* decl) { return classify(decl).Concurrent; }
+
+    // the arguments of the refl_tag attributes, valid until the next
+    // declaration is classified
+    ArrayRef<const Expr*> tags(const Decl* decl) { return classify(decl).Tags; }
+
+private:
+    struct Entry {
+        ReflSpec Spec = ReflSpec::unknown;
+        std::optional<unsigned> Categories;
+        bool Closed     = false;
+        bool Concurrent = false;
+        SmallVector<const Expr*, 2> Tags;
+    };
+
+    const Entry& classify(const Decl* decl);
+
+    DenseMap<const Decl*, Entry> Entries_;
+};
+
+const ReflAttrs::Entry& ReflAttrs::classify(const Decl* decl)
 {
-    if (Node.isDefinedOutsideFunctionOrMethod()) {
-        auto ctx = Node.getDeclContext();
-        if (isa<RecordDecl>(ctx)) {
-            auto r = static_cast<const RecordDecl*>(ctx);
-            return Record == r;
+    auto [It, Inserted] = Entries_.try_emplace(decl);
+    auto& E{It->second};
+    if (!Inserted)
+        return E;
+
+    bool Categorized = false;
+    for (const auto* a : decl->specific_attrs<AnnotateAttr>()) {
+        auto Annotation{a->getAnnotation()};
+        if (E.Spec == ReflSpec::unknown) {
+            E.Spec = StringSwitch<ReflSpec>(Annotation)
+                         .Case("refl_all", ReflSpec::all)
+                         .Case("refl_data", ReflSpec::all)
+                         .Case("refl_only", ReflSpec::all)
+                         .Case("refl_none", ReflSpec::none)
+                         .Case("refl_include", ReflSpec::include)
+                         .Case("refl_exclude", ReflSpec::exclude)
+                         .Case("refl_tag", ReflSpec::tag)
+                         .Default(ReflSpec::unknown);
+        }
+
+        if (Annotation == "refl_data" && !Categorized) {
+            E.Categories = ReflBases | ReflVariables;
+            Categorized  = true;
+        } else if (Annotation == "refl_only" && a->args_size() == 1 && !Categorized) {
+            if (auto* List = dyn_cast<StringLiteral>((*a->args_begin())->IgnoreParenImpCasts())) {
+                E.Categories = parseCategories(List->getString());
+                Categorized  = true;
+            }
+        } else if (Annotation == "refl_closed") {
+            E.Closed = true;
+        } else if (Annotation == "refl_tag") {
+            for (const auto* arg : a->args()) {
+                E.Tags.push_back(arg);
+                const auto* tag = arg->getType()->getAsCXXRecordDecl();
+                if (tag && tag->getQualifiedNameAsString() == "refl::concurrent")
+                    E.Concurrent = true;
+            }
         }
     }
-    return false;
+    return E;
 }
 
-#pragma clang diagnostic pop
-
 class ReflError : public std::exception {
 public:
     ReflError(std::string const& What, SourceLocation const& Where)
@@ -177,516 +310,1922 @@ char const* ReflError::what() const noexcept
     return What_.c_str();
 }
 
-template <typename C>
-class ReflStaticMatchCallback
-    : public ast_matchers::MatchFinder::MatchCallback {
+static const char* accessName(AccessSpecifier acc)
+{
+    switch (acc) {
+    case AccessSpecifier::AS_private:
+        return "Private";
+    case AccessSpecifier::AS_public:
+        return "Public";
+    case AccessSpecifier::AS_protected:
+        return "Protected";
+    case AccessSpecifier::AS_none:
+    default:
+        errs() << "Unexpected None access specifier\n";
+        assert(false);
+        return "Public";
+    }
+}
+
+// appends the arguments of the refl_tag attributes of the declaration
+static void appendTags(std::string& ss, const Decl* decl, ReflAttrs* Attrs, const SourceManager& SourceManager, ASTContext& Context_)
+{
+    for (const auto* arg : Attrs->tags(decl)) {
+        ss += formatv(",{0}", Lexer::getSourceText(CharSourceRange::getTokenRange(arg->getSourceRange()), SourceManager, Context_.getLangOpts()));
+    }
+}
+
+// the noexcept argument of refl::Func, empty when the function may throw. A
+// dependent noexcept(expr) is copied as written, it can only be resolved in
+// the scope of the record. The exception specification of defaulted
+// functions is computed on their first use, it is not known here.
+static std::string noexceptArg(const FunctionDecl* func, const SourceManager& SourceManager, ASTContext& Context_, bool Qualified)
+{
+    const auto* proto = func->getType()->getAs<FunctionProtoType>();
+    if (!proto)
+        return "";
+    auto est = proto->getExceptionSpecType();
+    if (est == EST_DependentNoexcept) {
+        if (Qualified)
+            return "";
+        auto expr = Lexer::getSourceText(CharSourceRange::getTokenRange(proto->getNoexceptExpr()->getSourceRange()), SourceManager, Context_.getLangOpts());
+        return formatv(",static_cast<bool>({0})", expr);
+    }
+    if (isUnresolvedExceptionSpec(est) || est == EST_Uninstantiated)
+        return "";
+    return proto->isNothrow() ? ",true" : "";
+}
+
+// prints the type as written, or fully qualified when the metadata is placed
+// outside the scope of the reflected type
+static std::string typeName(QualType type, ASTContext& Context_, bool Qualified)
+{
+    if (Qualified)
+        return TypeName::getFullyQualifiedName(type, Context_, Context_.getPrintingPolicy());
+    auto name  = type.getAsString();
+    auto found = name.find("_Bool");
+    if (found != std::string::npos) name.replace(found, 5, "bool");
+    return name;
+}
+
+struct ReflParams {
+    // comma separated parameter types as written, used in the names
+    std::string spelling;
+    // comma separated parameter types as the metadata refers to them
+    std::string types;
+    // comma separated parameter names
+    std::string names;
+    unsigned count = 0;
+};
+
+static ReflParams generateParams(const FunctionDecl* decl, ASTContext& Context_, bool Qualified)
+{
+    ReflParams params;
+    for (bool f = false; const auto& p : decl->parameters()) {
+        if (f) {
+            params.spelling += ',';
+            params.types += ',';
+            params.names += ',';
+        }
+        f = true;
+        params.spelling += typeName(p->getType(), Context_, false);
+        params.types += typeName(p->getType(), Context_, Qualified);
+        params.names += p->getNameAsString();
+        params.count++;
+    }
+    return params;
+}
+
+// The names of a record and its members, generated as a single string. The
+// qualified name of the record comes first, every other name is added once
+// and referred to by its offset and length.
+class StringPool {
 public:
-    ReflStaticMatchCallback(C&& callback)
-        : callback{std::forward<C>(callback)}
+    explicit StringPool(std::string Prefix)
+        : Text_(std::move(Prefix))
+        , Prefix_(Text_.size())
     {
     }
-    void
-    run(ast_matchers::MatchFinder::MatchResult const& Result) override
+
+    size_t add(StringRef Name)
     {
-        callback(Result);
+        if (auto Found{StringRef(Text_).find(Name)}; Found != StringRef::npos)
+            return Found;
+        Text_ += Name;
+        return Text_.size() - Name.size();
     }
-    C callback;
-};
-template <typename C> ReflStaticMatchCallback(C) -> ReflStaticMatchCallback<C>;
 
-class ReflRecordMatchCallback
-    : public ast_matchers::MatchFinder::MatchCallback {
-public:
-    ReflRecordMatchCallback(ASTContext& Context, FileID* FileID, Rewriter* FileRewriter)
-        : Context_(Context)
-        , FileID_(FileID)
-        , FileRewriter_(FileRewriter)
+    // the members of the struct the metadata refers to as the pool
+    std::string body() const
     {
+        return formatv("static constexpr refl::detail::string_pool value(){{return{{\"{0}\",{1}};}", Text_, Prefix_);
     }
-    void run(ast_matchers::MatchFinder::MatchResult const& Result) override;
 
 private:
-    std::set<void*> unique;
-    ASTContext& Context_;
-    FileID* FileID_;
-    Rewriter* FileRewriter_;
+    std::string Text_;
+    size_t Prefix_;
+};
+
+// With refl::none only the explicitly marked members are reflected, the
+// marked members are reflected in every category. Spec and Categories are
+// those of the record.
+static bool isReflectedMember(const Decl* decl, ReflAttrs* Attrs, ReflSpec spec, unsigned Categories, ReflCategory category)
+{
+    auto mspec = Attrs->spec(decl);
+    if (mspec == ReflSpec::exclude)
+        return false;
+    if (mspec == ReflSpec::include || mspec == ReflSpec::tag)
+        return true;
+    return spec != ReflSpec::none && (Categories & category);
+}
+
+struct RecordMeta {
+    // members of the struct named by Pool
+    std::string pool;
+    // members of the struct named by Bits, empty without bit-fields
+    std::string bits;
+    std::string meta;
 };
 
-void ReflRecordMatchCallback::run(ast_matchers::MatchFinder::MatchResult const& Result)
+// With Qualified every type is named by its fully qualified name, so the
+// metadata can be used outside the scope of the record. Pool names the struct
+// the caller declares with the body of the string pool, Bits the one with the
+// accessors of the bit-fields, declared where the private members can be named.
+// Categories are the defaults of the project, see ReflAttrs::categories.
+static RecordMeta generateRecordMeta(const CXXRecordDecl* recordDecl, ReflAttrs* Attrs, ASTContext& Context_, bool Qualified, StringRef Pool, StringRef Bits, unsigned Categories)
 {
     auto& SourceManager{Context_.getSourceManager()};
-    auto recordDecl{
-        Result.Nodes.getNodeAs<CXXRecordDecl>("refl_record")
+    auto spec  = Attrs->spec(recordDecl);
+    Categories = Attrs->categories(recordDecl, Categories);
+
+    auto reflected = [&](const Decl* decl, ReflCategory category) {
+        return isReflectedMember(decl, Attrs, spec, Categories, category);
     };
-    auto enumDecl{Result.Nodes.getNodeAs<EnumDecl>("refl_enum")};
-    if (recordDecl) {
-        if (unique.contains(recordDecl->getLocation().getPtrEncoding()))
-            return;
-        unique.insert(recordDecl->getLocation().getPtrEncoding());
-
-        auto spec = getReflSpec(recordDecl, SourceManager, Context_);
-
-        const auto& sname = recordDecl->getName();
-        const auto& qname = recordDecl->getQualifiedNameAsString();
-        std::string ss;
-        ss +=
-            formatv("public:using _meta=refl::RecordType<{0},\"{0}\",\"{1}\",REFL_TUPLE<", sname, qname);
-        {
-            for (int i = 0; auto& it : recordDecl->bases()) {
-                auto acc = it.getAccessSpecifier();
-                const char* str;
-                if (acc == AccessSpecifier::AS_private)
-                    str = "Private";
-                if (acc == AccessSpecifier::AS_public)
-                    str = "Public";
-                if (acc == AccessSpecifier::AS_protected)
-                    str = "Protected";
-                if (i++ != 0)
-                    ss += ",";
-                ss += formatv("refl::Base<{1},refl::AccessSpecifier::{0}>", str, it.getType().getAsString());
-            }
-        }
-        ss += ">,REFL_TUPLE<";
-        {
-            int i = 0;
-            for (const auto it : recordDecl->methods()) {
-                if (isa<CXXConstructorDecl>(it) ||
-                    isa<CXXDestructorDecl>(it) ||
-                    it->isImplicit() || it->isDeleted())
-                    continue;
-                auto mspec = getReflSpec(it, SourceManager, Context_);
-                if (mspec == ReflSpec::exclude)
-                    continue;
-                if (spec == ReflSpec::none && mspec != ReflSpec::include &&
-                    mspec != ReflSpec::tag)
-                    continue;
-                auto acc = it->getAccess();
-                const char* accs;
-                switch (acc) {
-                case AccessSpecifier::AS_private:
-                    accs = "Private";
-                    break;
-                case AccessSpecifier::AS_public:
-                    accs = "Public";
-                    break;
-                case AccessSpecifier::AS_protected:
-                    accs = "Protected";
-                    break;
-                case AccessSpecifier::AS_none:
-                default:
-                    errs() << "Unexpected None access specifier\n";
-                    assert(false);
-                }
-                auto str   = it->getNameAsString(); // TODO: deprecated
-                auto strq  = it->getQualifiedNameAsString();
-                auto ret   = it->getReturnType().getAsString();
-                auto found = ret.find("_Bool");
-                if (found != std::string::npos) ret.replace(found, 5, "bool ");
-                auto qual              = it->getMethodQualifiers().getAsString();
-                auto ref               = it->getRefQualifier();
-                std::string params     = "";
-                std::string paramNames = "";
-                for (bool f = false; const auto& p : it->parameters()) {
-                    if (f) {
-                        params += ',';
-                    }
-                    f           = true;
-                    auto pname  = p->getType().getAsString();
-                    auto found2 = pname.find("_Bool");
-                    if (found2 != std::string::npos) pname.replace(found2, 5, "bool");
-                    params += pname;
-                    paramNames += formatv(",\"{0}\"", p->getNameAsString());
-                }
-                std::string rqual;
-                if (ref == RefQualifierKind::RQ_LValue)
-                    rqual = formatv("{0} &", qual);
-                else if (ref == RefQualifierKind::RQ_RValue)
-                    rqual = formatv("{0} &&", qual);
-                else
-                    rqual = formatv("{0}", qual);
-
-                if (i++ != 0)
-                    ss += ',';
-                if (it->isInstance()) {
-                    ss += formatv("refl::Func<static_cast<{0}({1}::*)", ret, sname);
-                } else {
-                    ss += formatv("refl::Func<static_cast<{0}(*)", ret);
-                }
-                ss +=
-                    formatv("({0}){6}>(&{1}::{2}),\"{2}\",\"{3}\",\"{2}({0}){6}\",{4}"
-                            ",refl::AccessSpecifier::{5},{7},refl::PList<REFL_TUPLE<{8}>{9}>",
-                            params, sname, str, strq, it->isVirtual(), accs, rqual, ret, params, paramNames);
-                const auto& attrs = it->getAttrs();
-                for (auto a : attrs) {
-                    if (!strcmp(a->getSpelling(), "annotate")) {
-                        auto s = static_cast<std::string_view>(Lexer::getSourceText(
-                            CharSourceRange::getTokenRange(a->getRange()),
-                            SourceManager, Context_.getLangOpts()
-                        ));
-                        if (!s.starts_with("refl_tag"))
-                            continue;
-                        auto f = s.find_first_of('(');
-                        auto l = s.find_last_of(')');
-                        ss += formatv(",{0}", s.substr(f + 1, l - f - 1));
-                    }
-                }
-                ss += '>';
+    auto append = [](std::string& list, std::string const& item) {
+        if (!list.empty())
+            list += ',';
+        list += item;
+    };
+
+    const auto& sname = recordDecl->getName();
+    const auto& qname = recordDecl->getQualifiedNameAsString();
+    const auto tname  = Qualified ? typeName(Context_.getRecordType(recordDecl), Context_, true) : sname.str();
+
+    StringPool Names{qname};
+    auto plist = [&](ReflParams const& params) {
+        return formatv("refl::PList<refl::detail::list<{0}>,refl::detail::param_names<{1},{2},{3},{4}>>", params.types, Pool, Names.add(params.names), params.names.size(), params.count).str();
+    };
+
+    // the layout of class templates depends on the arguments, their variables
+    // are left without offset
+    const ASTRecordLayout* Layout = nullptr;
+    if (!recordDecl->isDependentContext() && !recordDecl->isInvalidDecl())
+        Layout = &Context_.getASTRecordLayout(recordDecl);
+
+    std::string bases;
+    std::string accessors;
+    for (auto& it : recordDecl->bases()) {
+        if (!(Categories & ReflBases))
+            break;
+        append(bases, formatv("refl::Base<{1},refl::AccessSpecifier::{0}>", accessName(it.getAccessSpecifier()), typeName(it.getType(), Context_, Qualified)));
+    }
+
+    // relocating the record relocates its bases and variables one by one when
+    // all of them are reflected and neither the copy and move constructors
+    // nor the destructor are user-provided or explicitly deleted, see
+    // refl::is_trivially_relocatable. The copy constructor implicitly deleted
+    // by a user-declared move constructor doesn't prevent it.
+    auto userProvided = [](const CXXMethodDecl* method) {
+        return method && (method->isUserProvided() || (method->isDeleted() && !method->isImplicit()));
+    };
+    bool relocatable  = recordDecl->getNumVBases() == 0 && !userProvided(recordDecl->getDestructor()) &&
+                       ((Categories & ReflBases) || recordDecl->getNumBases() == 0);
+
+    // every member category is collected in a single walk over the record,
+    // static data members are listed after the non-static ones
+    std::string functions, fields, statics, constructors;
+    for (const auto* decl : recordDecl->decls()) {
+        if (const auto* ctor = dyn_cast<CXXConstructorDecl>(decl)) {
+            if (ctor->isCopyOrMoveConstructor() && userProvided(ctor))
+                relocatable = false;
+            if (ctor->isDeleted() || !reflected(ctor, ReflConstructors))
+                continue;
+            auto params    = generateParams(ctor, Context_, Qualified);
+            auto name      = formatv("{0}({1})", sname, params.spelling).str();
+            std::string info = formatv("refl::ConstrInfo<{0},{1},{2}", Pool, Names.add(name), name.size());
+            appendTags(info, ctor, Attrs, SourceManager, Context_);
+            append(constructors, formatv("refl::Constr<{0}>,{1},{2}>", info, tname, plist(params)));
+        } else if (const auto* method = dyn_cast<CXXMethodDecl>(decl)) {
+            if (isa<CXXDestructorDecl>(method) || method->isImplicit() ||
+                method->isDeleted() || !reflected(method, ReflFunctions))
+                continue;
+            auto str    = method->getNameAsString(); // TODO: deprecated
+            auto ret    = typeName(method->getReturnType(), Context_, Qualified);
+            auto qual   = method->getMethodQualifiers().getAsString();
+            auto ref    = method->getRefQualifier();
+            auto params = generateParams(method, Context_, Qualified);
+            std::string rqual;
+            if (ref == RefQualifierKind::RQ_LValue)
+                rqual = formatv("{0} &", qual);
+            else if (ref == RefQualifierKind::RQ_RValue)
+                rqual = formatv("{0} &&", qual);
+            else
+                rqual = formatv("{0}", qual);
+
+            std::string ss;
+            if (method->isInstance()) {
+                ss += formatv("refl::Func<static_cast<{0}({1}::*)", ret, tname);
+            } else {
+                ss += formatv("refl::Func<static_cast<{0}(*)", ret);
             }
-        }
-        ss += ">,REFL_TUPLE<";
-        {
-            int i = 0;
-            for (const auto it : recordDecl->fields()) {
-                auto mspec = getReflSpec(it, SourceManager, Context_);
-                if (mspec == ReflSpec::exclude)
-                    continue;
-                if (spec == ReflSpec::none && mspec != ReflSpec::include &&
-                    mspec != ReflSpec::tag)
-                    continue;
-                if (i++ != 0)
-                    ss += ',';
-                auto str  = it->getNameAsString();
-                auto strq = it->getQualifiedNameAsString();
-                auto acc  = it->getAccess();
-                const char* accs;
-                switch (acc) {
-                case AccessSpecifier::AS_private:
-                    accs = "Private";
-                    break;
-                case AccessSpecifier::AS_public:
-                    accs = "Public";
-                    break;
-                case AccessSpecifier::AS_protected:
-                    accs = "Protected";
-                    break;
-                case AccessSpecifier::AS_none:
-                default:
-                    errs() << "Unexpected None access specifier\n";
-                    assert(false);
-                }
-                ss += formatv("refl::Var<&{0}::{1},\"{1}\",\"{2}\",{3},"
-                              "refl::AccessSpecifier::{4}",
-                              sname, str, strq, it->isMutable(), accs);
-                const auto& attrs = it->getAttrs();
-                for (auto a : attrs) {
-                    if (!strcmp(a->getSpelling(), "annotate")) {
-                        auto s = static_cast<std::string_view>(Lexer::getSourceText(
-                            CharSourceRange::getTokenRange(a->getRange()),
-                            SourceManager, Context_.getLangOpts()
-                        ));
-                        if (!s.starts_with("refl_tag"))
-                            continue;
-                        auto f = s.find_first_of('(');
-                        auto l = s.find_last_of(')');
-                        ss += formatv(",{0}", s.substr(f + 1, l - f - 1));
-                    }
-                }
-                ss += '>';
+            // the name is the beginning of the full name
+            auto full        = formatv("{0}({1}){2}", str, params.spelling, rqual).str();
+            std::string info = formatv("refl::FuncInfo<{0},{1},{2},{3},{4},{5},{6},refl::AccessSpecifier::{7}",
+                                       Pool, Names.add(full), str.size(), full.size(), method->isVirtual(),
+                                       method->isInstance() && method->isConst(), method->isConstexpr(), accessName(method->getAccess()));
+            appendTags(info, method, Attrs, SourceManager, Context_);
+            ss += formatv("({0}){1}>(&{2}::{3}),{4}>,{5},{6}{7}>", params.types, rqual, tname, str, info, ret, plist(params),
+                          noexceptArg(method, SourceManager, Context_, Qualified));
+            append(functions, ss);
+        } else if (const auto* field = dyn_cast<FieldDecl>(decl)) {
+            if (field->isUnnamedBitField())
+                continue;
+            if (!reflected(field, ReflVariables)) {
+                relocatable = false;
+                continue;
             }
-
-            using namespace ast_matchers;
-
-            auto ReflectStaticMatchExpression(
-                varDecl(isStaticFieldOf(recordDecl))
-            );
-
-            ReflStaticMatchCallback match{[&](const auto& res) {
-                auto staticDecl{
-                    res.Nodes.template getNodeAs<VarDecl>(
-                        "refl_static"
-                    )
-                };
-                if (staticDecl) {
-                    auto& it = staticDecl;
-                    auto mspec =
-                        getReflSpec(staticDecl, SourceManager, Context_);
-                    bool ok = false;
-                    if (spec != ReflSpec::unknown &&
-                        (mspec == ReflSpec::include ||
-                         mspec == ReflSpec::tag))
-                        ok = true;
-                    if (spec == ReflSpec::all && mspec != ReflSpec::exclude)
-                        ok = true;
-                    if (ok) {
-                        if (i++ != 0)
-                            ss += ',';
-                        auto str  = it->getNameAsString();
-                        auto strq = it->getQualifiedNameAsString();
-                        auto acc  = it->getAccess();
-                        const char* accs;
-                        switch (acc) {
-                        case AccessSpecifier::AS_private:
-                            accs = "Private";
-                            break;
-                        case AccessSpecifier::AS_public:
-                            accs = "Public";
-                            break;
-                        case AccessSpecifier::AS_protected:
-                            accs = "Protected";
-                            break;
-                        case AccessSpecifier::AS_none:
-                        default:
-                            errs() << "Unexpected None access specifier\n";
-                            assert(false);
-                        }
-                        ss += formatv("refl::Var<&{0}::{1},\"{1}\",\"{2}\","
-                                      "{3},refl::AccessSpecifier::{4}",
-                                      sname, str, strq, false, accs);
-                        const auto& attrs = it->getAttrs();
-                        for (auto a : attrs) {
-                            if (!strcmp(a->getSpelling(), "annotate")) {
-                                auto s = static_cast<std::string_view>(Lexer::getSourceText(
-                                    CharSourceRange::getTokenRange(
-                                        a->getRange()
-                                    ),
-                                    SourceManager,
-                                    Context_.getLangOpts()
-                                ));
-                                if (!s.starts_with("refl_tag"))
-                                    continue;
-                                auto f = s.find_first_of('(');
-                                auto l = s.find_last_of(')');
-                                ss += formatv(",{0}", s.substr(f + 1, l - f - 1));
-                            }
-                        }
-                        ss += '>';
-                    }
-                }
-            }};
-
-            ast_matchers::MatchFinder MatchFinder;
-            MatchFinder.addMatcher(
-                ReflectStaticMatchExpression.bind("refl_static"), &match
-            );
-            MatchFinder.matchAST(Context_);
-        }
-
-        ss += ">,REFL_TUPLE<";
-        {
-            for (int f = 0; const auto it : recordDecl->methods()) {
-                if (!isa<CXXConstructorDecl>(it) ||
-                    it->isDeleted())
-                    continue;
-                auto mspec = getReflSpec(it, SourceManager, Context_);
-                if (mspec == ReflSpec::exclude)
-                    continue;
-                if (spec == ReflSpec::none && mspec != ReflSpec::include &&
-                    mspec != ReflSpec::tag)
-                    continue;
-                if (f++)
-                    ss += ',';
-                ss += "refl::Constr<";
-                std::string params     = "";
-                std::string paramNames = "";
-                for (int f1 = 0; const auto& p : it->parameters()) {
-                    if (f1++) {
-                        params += ',';
-                    }
-                    auto pname  = p->getType().getAsString();
-                    auto found2 = pname.find("_Bool");
-                    if (found2 != std::string::npos) pname.replace(found2, 5, "bool");
-                    params += pname;
-                    paramNames += formatv(",\"{0}\"", p->getNameAsString());
-                }
-                ss += formatv("\"{1}({0})\",{1},refl::PList<REFL_TUPLE<{0}>{2}>", params, sname, paramNames);
-                const auto& attrs = it->getAttrs();
-                for (auto a : attrs) {
-                    if (!strcmp(a->getSpelling(), "annotate")) {
-                        auto s  = static_cast<std::string_view>(Lexer::getSourceText(
-                            CharSourceRange::getTokenRange(a->getRange()),
-                            SourceManager, Context_.getLangOpts()
-                        ));
-                        auto f2 = s.find_first_of('(');
-                        auto l  = s.find_last_of(')');
-                        ss += formatv(",{0}", s.substr(f2 + 1, l - f2 - 1));
-                    }
-                }
-                ss += '>';
+            auto name      = field->getNameAsString();
+            std::string info = formatv("refl::VarInfo<{0},{1},{2},{3},refl::AccessSpecifier::{4}",
+                                       Pool, Names.add(name), name.size(), field->isMutable(), accessName(field->getAccess()));
+            appendTags(info, field, Attrs, SourceManager, Context_);
+            // bit-fields have no member pointer, they are accessed through the
+            // functions of Bits and their offset is in bits. Unlike lambdas in
+            // the metadata, they are the same in every translation unit.
+            if (field->isBitField()) {
+                const auto* width = field->getBitWidth();
+                std::string bits  = width->isValueDependent()
+                                        ? formatv("({0})", Lexer::getSourceText(CharSourceRange::getTokenRange(width->getSourceRange()), SourceManager, Context_.getLangOpts())).str()
+                                        : std::to_string(width->EvaluateKnownConstInt(Context_).getZExtValue());
+                std::string offset;
+                if (Layout)
+                    offset = formatv(",{0}", Layout->getFieldOffset(field->getFieldIndex()));
+                accessors += formatv("static constexpr decltype({0}::{1}) get_{1}({0} const&_refl_o){{return _refl_o.{1};}"
+                                     "static constexpr void set_{1}({0}&_refl_o,decltype({0}::{1})_refl_v){{_refl_o.{1}=_refl_v;}",
+                                     tname, name);
+                append(fields, formatv("refl::BitVar<{0},{1}>,&{2}::get_{3},&{2}::set_{3},{4}{5}>", tname, info, Bits, name, bits, offset));
+                continue;
             }
+            std::string offset;
+            if (Layout)
+                offset = formatv(",{0}", Context_.toCharUnitsFromBits(Layout->getFieldOffset(field->getFieldIndex())).getQuantity());
+            append(fields, formatv("refl::Var<&{0}::{1},{2}>{3}>", tname, name, info, offset));
+        } else if (const auto* var = dyn_cast<VarDecl>(decl)) {
+            if (!reflected(var, ReflVariables))
+                continue;
+            auto name      = var->getNameAsString();
+            std::string info = formatv("refl::VarInfo<{0},{1},{2},{3},refl::AccessSpecifier::{4}",
+                                       Pool, Names.add(name), name.size(), false, accessName(var->getAccess()));
+            appendTags(info, var, Attrs, SourceManager, Context_);
+            append(statics, formatv("refl::Var<&{0}::{1},{2}>>", tname, name, info));
         }
+    }
+    if (!statics.empty())
+        append(fields, statics);
 
-        ss += ">>;";
+    auto meta = formatv("refl::RecordType<{0},refl::RecordInfo<{1},{2},{3},{8}>,refl::detail::list<{4}>,refl::detail::list<{5}>,refl::detail::list<{6}>,refl::detail::list<{7}>>",
+                        tname, Pool, Names.add(sname), sname.size(), bases, functions, fields, constructors, relocatable);
+    return {Names.body(), accessors, meta};
+}
 
-        FileRewriter_->InsertTextAfter(recordDecl->getEndLoc(), ss);
-        *FileID_ = SourceManager.getFileID(recordDecl->getBeginLoc());
-    } else if (enumDecl) {
-        std::string ss;
-        const auto& sname = enumDecl->getDeclName();
-        const auto& qname = enumDecl->getQualifiedNameAsString();
-        int count         = 0;
-        for (auto _ : enumDecl->enumerators()) count++;
-
-        ss +=
-            formatv("template<>struct refl::meta<{0}>:EnumType<{0},\"{1}\",\"{0}\">{static "
-                    "constexpr std::array<refl::Enumerator<{0}>,{2}>enumerators={{",
-                    qname, sname, count);
-
-        for (int f = 0; const auto e : enumDecl->enumerators()) {
-            const auto& n = e->getName();
-            if (f++)
-                ss += ',';
-            ss += formatv("refl::Enumerator<{0}>{{\"{1}\",{0}::{1}}", qname, n);
-        }
-
-        ss += formatv(
-            "};static constexpr bool valid({0} v)noexcept{{for(const "
-            "auto&e:enumerators)if(e.value==v)return true;return "
-            "false;}static constexpr std::string_view to_string({0} "
-            "v)noexcept{{switch(v){{",
-            qname
-        );
+// How the metadata is generated, set by the plugin arguments. The attributes
+// are empty when not used.
+struct ReflGenOptions {
+    // added to the generated structs
+    std::string Type;
+    // added to the static members and functions of the generated structs
+    std::string Member;
+    // the categories of records without refl::data or refl_only
+    unsigned Categories = ReflAllCategories;
+};
 
-        for (const auto e : enumDecl->enumerators()) {
-            const auto& n = e->getName();
-            ss += formatv("case {0}::{1}:return\"{1}\";", qname, n);
-        }
+// generates the body of the enum metadata, the head of the struct is added by the caller
+static std::string generateEnumMeta(const EnumDecl* enumDecl, StringRef Member)
+{
+    std::string ss;
+    const auto& qname = enumDecl->getQualifiedNameAsString();
+    int count         = 0;
+    for (auto _ : enumDecl->enumerators()) count++;
+
+    ss += formatv("{{{2}static constexpr refl::detail::array<refl::Enumerator<{0}>,{1}>enumerators={{", qname, count, Member);
+
+    for (int f = 0; const auto e : enumDecl->enumerators()) {
+        const auto& n = e->getName();
+        if (f++)
+            ss += ',';
+        ss += formatv("refl::Enumerator<{0}>{{\"{1}\",{0}::{1}}", qname, n);
+    }
 
-        ss += formatv("default:{{assert(false);__builtin_unreachable();}}}"
-                      "static constexpr std::string_view "
-                      "to_string_safe({0} v)noexcept{{switch(v){{",
-                      qname);
+    ss += formatv(
+        "};{1}static constexpr bool valid({0} v)noexcept{{for(const "
+        "auto&e:enumerators)if(e.value==v)return true;return "
+        "false;}{1}static constexpr refl::detail::string_view to_string({0} "
+        "v)noexcept{{switch(v){{",
+        qname, Member
+    );
 
-        for (const auto e : enumDecl->enumerators()) {
-            const auto& n = e->getName();
-            ss += formatv("case {0}::{1}:return\"{1}\";", qname, n);
-        }
+    for (const auto e : enumDecl->enumerators()) {
+        const auto& n = e->getName();
+        ss += formatv("case {0}::{1}:return\"{1}\";", qname, n);
+    }
 
-        ss += formatv(
-            "default:return{{};}}static constexpr "
-            "std::optional<{0}>from_string(std::string_view "
-            "n)noexcept{{for(const auto&e:enumerators)if(e.name==n)return "
-            "e.value;return std::nullopt;}};",
-            qname
-        );
+    ss += formatv("default:refl::detail::unreachable();}}"
+                  "{1}static constexpr refl::detail::string_view "
+                  "to_string_safe({0} v)noexcept{{switch(v){{",
+                  qname, Member);
 
-        SourceLocation loc;
-        const DeclContext* p = enumDecl;
-        while (!p->getParent()->isTranslationUnit()) {
-            p = p->getParent();
-        }
-        if (isa<NamespaceDecl>(p)) {
-            loc = static_cast<const NamespaceDecl*>(p)
-                      ->getEndLoc()
-                      .getLocWithOffset(1);
-        } else if (isa<TagDecl>(p)) {
-            loc = Lexer::findLocationAfterToken(
-                      static_cast<const TagDecl*>(p)->getEndLoc(),
-                      tok::TokenKind::semi, SourceManager,
-                      Context_.getLangOpts(), true
-            )
-                      .getLocWithOffset(-1);
-        }
+    for (const auto e : enumDecl->enumerators()) {
+        const auto& n = e->getName();
+        ss += formatv("case {0}::{1}:return\"{1}\";", qname, n);
+    }
 
-        if (loc.isValid()) {
-            FileRewriter_->InsertTextAfter(loc, ss);
-            *FileID_ = SourceManager.getFileID(enumDecl->getBeginLoc());
+    ss += formatv(
+        "default:return{{};}}{1}static constexpr "
+        "refl::detail::optional<{0}>from_string(refl::detail::string_view "
+        "n)noexcept{{auto h=refl::hash_name(n);for(const auto&e:enumerators)if(e.name_hash==h&&e.name==n)return "
+        "e.value;return refl::detail::nullopt;}};",
+        qname, Member
+    );
+    return ss;
+}
+
+// Per translation unit counters reported by '-fplugin-arg-reflect-stats'.
+// Times are in seconds, the traversal includes the generation.
+struct ReflStats {
+    unsigned Records      = 0;
+    unsigned Enums        = 0;
+    size_t Bytes          = 0;
+    double TraversalTime  = 0;
+    double GenerationTime = 0;
+    double RewriteTime    = 0;
+    double RecompileTime  = 0;
+    std::string LargestName;
+    size_t LargestBytes = 0;
+
+    void add(const TagDecl* D, std::string const& Meta)
+    {
+        ++(isa<EnumDecl>(D) ? Enums : Records);
+        Bytes += Meta.size();
+        if (Meta.size() > LargestBytes) {
+            LargestBytes = Meta.size();
+            LargestName  = D->getQualifiedNameAsString();
         }
     }
-}
+};
 
-class ReflConsumer : public ASTConsumer {
+// Measures a phase of the plugin, it shows up as a section of the
+// -ftime-trace output and is added to the given counter of ReflStats.
+class ReflTimer {
 public:
-    ReflConsumer(FileID* FileID, Rewriter* FileRewriter, bool* FileRewriteError)
-        : FileID_(FileID)
-        , FileRewriter_(FileRewriter)
-        , FileRewriteError_(FileRewriteError)
+    ReflTimer(double& Seconds, StringRef Name)
+        : Scope_(Name)
+        , Seconds_(Seconds)
     {
     }
 
-    void HandleTranslationUnit(ASTContext& Context) override;
+    ReflTimer(double& Seconds, StringRef Name, function_ref<std::string()> Detail)
+        : Scope_(Name, Detail)
+        , Seconds_(Seconds)
+    {
+    }
+
+    ReflTimer(ReflTimer const&)            = delete;
+    ReflTimer& operator=(ReflTimer const&) = delete;
+
+    ~ReflTimer()
+    {
+        Seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - Start_).count();
+    }
 
 private:
-    FileID* FileID_;
-    Rewriter* FileRewriter_;
-    bool* FileRewriteError_;
+    TimeTraceScope Scope_;
+    double& Seconds_;
+    std::chrono::steady_clock::time_point Start_ = std::chrono::steady_clock::now();
 };
 
-void ReflConsumer::HandleTranslationUnit(ASTContext& Context)
-{
-    using namespace ast_matchers;
+// Keeps the generated metadata of records and enums on disk, so the types of
+// widely included headers are generated once and read back by every later
+// translation unit. Entries are keyed by the declaration and by the options
+// that can change how it is parsed.
+class ReflCache {
+public:
+    ReflCache(std::string Dir)
+        : Dir_(std::move(Dir))
+    {
+    }
+
+    void setOptionsHash(std::string Hash) { OptionsHash_ = std::move(Hash); }
+
+    // Variant tells apart the different forms generated for the same declaration
+    template <typename F>
+    std::string get(TagDecl* D, ASTContext& Context, StringRef Variant, F&& Generate)
+    {
+        auto Path{path(D, Context, Variant)};
+        if (auto Buffer{MemoryBuffer::getFile(Path)}) {
+            ++Hits_;
+            return (*Buffer)->getBuffer().str();
+        }
+
+        ++Misses_;
+        std::string Meta{Generate()};
+        // parallel compilations may write the same entry, it is replaced atomically
+        consumeError(writeToOutput(Path, [&Meta](raw_ostream& OS) {
+            OS << Meta;
+            return Error::success();
+        }));
+        return Meta;
+    }
+
+    unsigned hits() const noexcept { return Hits_; }
+    unsigned misses() const noexcept { return Misses_; }
+
+private:
+    std::string path(TagDecl* D, ASTContext& Context, StringRef Variant) const;
 
-    auto ReflectedRecordsMatchExpression(cxxRecordDecl(
-        anyOf(hasReflectAttr("none"), hasReflectAttr("all"))
+    std::string Dir_;
+    std::string OptionsHash_;
+    unsigned Hits_   = 0;
+    unsigned Misses_ = 0;
+};
+
+// must be changed whenever the generated code changes
+static constexpr StringLiteral ReflCacheVersion{"refl-10"};
+
+std::string ReflCache::path(TagDecl* D, ASTContext& Context, StringRef Variant) const
+{
+    MD5 Hash;
+    Hash.update(ReflCacheVersion);
+    Hash.update(OptionsHash_);
+    Hash.update(Variant);
+    Hash.update(D->getQualifiedNameAsString());
+    Hash.update(Lexer::getSourceText(
+        CharSourceRange::getTokenRange(D->getSourceRange()),
+        Context.getSourceManager(), Context.getLangOpts()
     ));
-    auto ReflectedEnumMatchExpression(
-        enumDecl(anyOf(hasReflectAttr("none"), hasReflectAttr("all")))
-    );
+    // the text does not change with the macros it uses, the ODR hash does
+    if (auto recordDecl = dyn_cast<CXXRecordDecl>(D)) {
+        Hash.update(std::to_string(recordDecl->getODRHash()));
+        // neither of them changes with the size of the types of the members,
+        // the offsets in the metadata do
+        if (!recordDecl->isDependentContext() && !recordDecl->isInvalidDecl()) {
+            const auto& Layout{Context.getASTRecordLayout(recordDecl)};
+            Hash.update(formatv("{0},{1}", Layout.getSize().getQuantity(), Layout.getAlignment().getQuantity()).str());
+            for (const auto& base : recordDecl->bases()) {
+                if (auto baseDecl = base.getType()->getAsCXXRecordDecl(); baseDecl && !base.isVirtual())
+                    Hash.update(formatv(",{0}", Layout.getBaseClassOffset(baseDecl).getQuantity()).str());
+            }
+            for (unsigned i = 0; i != Layout.getFieldCount(); ++i)
+                Hash.update(formatv(",{0}", Layout.getFieldOffset(i)).str());
+        }
+    } else if (auto enumDecl = dyn_cast<EnumDecl>(D))
+        Hash.update(std::to_string(enumDecl->getODRHash()));
 
-    ReflRecordMatchCallback MatchRecordCallback(Context, FileID_, FileRewriter_);
+    MD5::MD5Result Result;
+    Hash.final(Result);
 
-    ast_matchers::MatchFinder MatchFinder;
+    SmallString<128> Path{Dir_};
+    sys::path::append(Path, Twine(Result.digest()) + ".refl");
+    return Path.str().str();
+}
 
-    MatchFinder.addMatcher(
-        ReflectedRecordsMatchExpression.bind("refl_record"),
-        &MatchRecordCallback
-    );
-    MatchFinder.addMatcher(ReflectedEnumMatchExpression.bind("refl_enum"), &MatchRecordCallback);
+// returns the metadata of the declaration, read from the cache when there is one
+template <typename F>
+static std::string cachedMeta(ReflCache* Cache, ReflStats* Stats, TagDecl* D, ASTContext& Context, StringRef Variant, F&& Generate)
+{
+    ReflTimer Timer{Stats->GenerationTime, "refl generate", [D] { return D->getQualifiedNameAsString(); }};
+    auto Meta{Cache ? Cache->get(D, Context, Variant, std::forward<F>(Generate)) : Generate()};
+    Stats->add(D, Meta);
+    return Meta;
+}
 
-    try {
-        MatchFinder.matchAST(Context);
-        *FileRewriteError_ = false;
-    } catch (ReflError const& e) {
-        auto& Diags{Context.getDiagnostics()};
+// the pool body, the accessors and the metadata of a record are cached on three lines
+static RecordMeta cachedRecordMeta(ReflCache* Cache, ReflStats* Stats, ReflAttrs* Attrs, CXXRecordDecl* D, ASTContext& Context, StringRef Variant, bool Qualified, StringRef Pool, StringRef Bits, unsigned Categories)
+{
+    auto Text{cachedMeta(Cache, Stats, D, Context, Variant, [&] {
+        auto Generated{generateRecordMeta(D, Attrs, Context, Qualified, Pool, Bits, Categories)};
+        return Generated.pool + '\n' + Generated.bits + '\n' + Generated.meta;
+    })};
+    auto [PoolBody, Rest]   = StringRef(Text).split('\n');
+    auto [BitsBody, Meta] = Rest.split('\n');
+    return {PoolBody.str(), BitsBody.str(), Meta.str()};
+}
 
-        unsigned ID{Diags.getDiagnosticIDs()->getCustomDiagID(
-            DiagnosticIDs::Error, e.what()
-        )};
+// the declaration of the struct with the accessors of the bit-fields, empty without them
+static std::string bitsStruct(StringRef Name, StringRef Body, StringRef Type)
+{
+    if (Body.empty())
+        return "";
+    return formatv("struct {2}{0}{{{1}};", Name, Body, Type);
+}
 
-        Diags.Report(e.where(), ID);
+static ClassTemplateDecl* findMetaTemplate(ASTContext& Context)
+{
+    for (auto* NS : Context.getTranslationUnitDecl()->lookup(&Context.Idents.get("refl"))) {
+        if (!isa<NamespaceDecl>(NS))
+            continue;
+        for (auto* D : cast<NamespaceDecl>(NS)->lookup(&Context.Idents.get("meta"))) {
+            if (isa<ClassTemplateDecl>(D))
+                return cast<ClassTemplateDecl>(D);
+        }
+    }
+    return nullptr;
+}
 
-        *FileRewriteError_ = true;
+static bool isReflected(const TagDecl* D, ReflAttrs* Attrs)
+{
+    if (!D->isThisDeclarationADefinition())
+        return false;
+    auto spec = Attrs->spec(D);
+    return spec == ReflSpec::all || spec == ReflSpec::none;
+}
+
+// Collects the types whose reflection is used in the translation unit: the
+// arguments of the refl::meta specializations and everything reachable from
+// them through bases, members, parameters and template arguments, because the
+// uses behind 'if constexpr (reflected<T>)' only appear once the metadata exists.
+static DenseSet<const Decl*> findDemandedTypes(ASTContext& Context, ReflAttrs* Attrs)
+{
+    DenseSet<const Decl*> Demand;
+    std::vector<QualType> Work;
+    if (auto Meta = findMetaTemplate(Context)) {
+        for (auto* Spec : Meta->specializations())
+            Work.push_back(Spec->getTemplateArgs()[0].getAsType());
+    }
+
+    while (!Work.empty()) {
+        auto Type{Work.back().getCanonicalType()};
+        Work.pop_back();
+        while (Type->isPointerType() || Type->isReferenceType() || Type->isArrayType()) {
+            Type = Type->isArrayType() ? Context.getBaseElementType(Type).getCanonicalType()
+                                       : Type->getPointeeType().getCanonicalType();
+        }
+
+        auto* Tag = Type->getAsTagDecl();
+        if (!Tag || !Demand.insert(Tag->getCanonicalDecl()).second)
+            continue;
+
+        auto* Record = dyn_cast<CXXRecordDecl>(Tag);
+        if (Record)
+            Record = Record->getDefinition();
+        if (!Record)
+            continue;
+
+        // the metadata of a template is generated into its pattern
+        auto* Pattern = Record->getTemplateInstantiationPattern();
+        if (Pattern)
+            Demand.insert(Pattern->getCanonicalDecl());
+        if (auto* Spec = dyn_cast<ClassTemplateSpecializationDecl>(Record)) {
+            for (auto& Arg : Spec->getTemplateArgs().asArray()) {
+                if (Arg.getKind() == TemplateArgument::Type)
+                    Work.push_back(Arg.getAsType());
+            }
+        }
+
+        if (!isReflected(Pattern ? Pattern : Record, Attrs))
+            continue;
+
+        for (auto& Base : Record->bases())
+            Work.push_back(Base.getType());
+        for (const auto* decl : Record->decls()) {
+            if (const auto* Function = dyn_cast<FunctionDecl>(decl)) {
+                Work.push_back(Function->getReturnType());
+                for (const auto* Param : Function->parameters())
+                    Work.push_back(Param->getType());
+            } else if (const auto* Value = dyn_cast<ValueDecl>(decl)) {
+                Work.push_back(Value->getType());
+            }
+        }
     }
+    return Demand;
 }
 
+// the end of the declaration at global scope containing D, where the
+// specializations of the templates of refl can be declared
+static SourceLocation specializationLoc(const TagDecl* D, ASTContext& Context)
+{
+    SourceLocation loc;
+    const DeclContext* p = D;
+    while (!p->getParent()->isTranslationUnit()) {
+        p = p->getParent();
+    }
+    if (isa<NamespaceDecl>(p)) {
+        loc = static_cast<const NamespaceDecl*>(p)
+                  ->getEndLoc()
+                  .getLocWithOffset(1);
+    } else if (isa<TagDecl>(p)) {
+        loc = Lexer::findLocationAfterToken(
+                  static_cast<const TagDecl*>(p)->getEndLoc(),
+                  tok::TokenKind::semi, Context.getSourceManager(),
+                  Context.getLangOpts(), true
+        )
+                  .getLocWithOffset(-1);
+    }
+    return loc;
+}
 
-class ReflectAction : public PluginASTAction {
-protected:
-    std::unique_ptr<ASTConsumer>
-    CreateASTConsumer(CompilerInstance& CI, StringRef FileName) override
-    {
-        auto& SourceManager{CI.getSourceManager()};
-        auto& LangOpts{CI.getLangOpts()};
+// Collects the closed hierarchies of the translation unit, the records marked
+// with refl::closed and the records deriving from them. The classes of a
+// hierarchy are numbered in preorder, so the classes deriving from one have
+// the numbers following it. Every class gets a virtual function returning its
+// number and a refl::hierarchy specialization with its range of numbers.
+class ReflHierarchies {
+public:
+    void add(const CXXRecordDecl* recordDecl, ReflAttrs* Attrs);
+    void generate(ASTContext& Context, Rewriter& FileRewriter);
 
-        CI_ = &CI;
+private:
+    // the roots in the order they are defined
+    SmallVector<const CXXRecordDecl*, 4> Roots_;
+    // the root of every class of a closed hierarchy
+    DenseMap<const CXXRecordDecl*, const CXXRecordDecl*> Root_;
+    // the direct derived classes of every class of a closed hierarchy
+    DenseMap<const CXXRecordDecl*, SmallVector<const CXXRecordDecl*, 4>> Derived_;
+};
 
-        FileName_ = FileName.str();
+void ReflHierarchies::add(const CXXRecordDecl* recordDecl, ReflAttrs* Attrs)
+{
+    if (!recordDecl->isThisDeclarationADefinition())
+        return;
 
-        FileRewriter_.setSourceMgr(SourceManager, LangOpts);
+    if (Attrs->closed(recordDecl)) {
+        if (recordDecl->isDependentContext())
+            throw ReflError{"refl: class templates can not be the root of a closed hierarchy", recordDecl};
+        if (!recordDecl->isPolymorphic())
+            throw ReflError{"refl: the root of a closed hierarchy must have a virtual function", recordDecl};
+        Roots_.push_back(recordDecl);
+        Root_[recordDecl] = recordDecl;
+    }
 
-        return std::make_unique<ReflConsumer>(&FileID_, &FileRewriter_, &FileRewriteError_);
+    // the bases are defined before, their hierarchy is already known
+    for (const auto& Base : recordDecl->bases()) {
+        const auto* BaseDecl = Base.getType()->getAsCXXRecordDecl();
+        if (!BaseDecl || !BaseDecl->hasDefinition())
+            continue;
+        auto Found{Root_.find(BaseDecl->getDefinition())};
+        if (Found == Root_.end())
+            continue;
+
+        auto* Root = Found->second;
+        if (recordDecl->isDependentContext() || recordDecl->getParentFunctionOrMethod())
+            throw ReflError{formatv("refl: class templates and local classes can not derive from the closed hierarchy of '{0}'", Root->getQualifiedNameAsString()), recordDecl};
+        // dyn_cast and visit_derived cast from the bases with static_cast
+        if (Base.isVirtual())
+            throw ReflError{formatv("refl: '{0}' can not derive virtually from the closed hierarchy of '{1}'", recordDecl->getQualifiedNameAsString(), Root->getQualifiedNameAsString()), Base.getBeginLoc()};
+        if (auto [It, Inserted] = Root_.try_emplace(recordDecl, Root); !Inserted) {
+            if (It->second == Root)
+                throw ReflError{formatv("refl: '{0}' derives from the closed hierarchy of '{1}' more than once", recordDecl->getQualifiedNameAsString(), Root->getQualifiedNameAsString()), recordDecl};
+            throw ReflError{formatv("refl: '{0}' is part of more than one closed hierarchy", recordDecl->getQualifiedNameAsString()), recordDecl};
+        }
+        Derived_[BaseDecl->getDefinition()].push_back(recordDecl);
     }
+}
 
-    bool ParseArgs(CompilerInstance const&, std::vector<std::string> const&) override;
+void ReflHierarchies::generate(ASTContext& Context, Rewriter& FileRewriter)
+{
+    auto& SourceManager{Context.getSourceManager()};
+    auto qualified = [&](const CXXRecordDecl* D) {
+        return typeName(Context.getRecordType(D), Context, true);
+    };
+    auto list = [&](ArrayRef<const CXXRecordDecl*> Decls) {
+        std::string Names;
+        for (const auto* D : Decls) {
+            if (!Names.empty())
+                Names += ',';
+            Names += qualified(D);
+        }
+        return formatv("refl::detail::list<{0}>", Names).str();
+    };
 
-    PluginASTAction::ActionType getActionType() override
-    {
-        return PluginASTAction::ReplaceAction;
+    for (const auto* Root : Roots_) {
+        // every class of the hierarchy has to be seen by every translation
+        // unit, so they all get the same numbers
+        auto File{SourceManager.getFileID(SourceManager.getExpansionLoc(Root->getBeginLoc()))};
+
+        SmallVector<const CXXRecordDecl*, 16> Order;
+        DenseMap<const CXXRecordDecl*, size_t> Last;
+        auto number = [&](auto& self, const CXXRecordDecl* D) -> void {
+            Order.push_back(D);
+            for (const auto* Derived : Derived_.lookup(D))
+                self(self, Derived);
+            Last[D] = Order.size() - 1;
+        };
+        number(number, Root);
+
+        auto rname             = qualified(Root);
+        const auto* LastDecl   = Root;
+        std::string Specializations;
+        for (size_t Id = 0; Id != Order.size(); ++Id) {
+            const auto* D = Order[Id];
+            if (SourceManager.getFileID(SourceManager.getExpansionLoc(D->getBeginLoc())) != File)
+                throw ReflError{formatv("refl: '{0}' must be defined in the file of '{1}', the root of its closed hierarchy", D->getQualifiedNameAsString(), Root->getQualifiedNameAsString()), D};
+            if (SourceManager.isBeforeInTranslationUnit(LastDecl->getEndLoc(), D->getEndLoc()))
+                LastDecl = D;
+
+            if (Id == 0)
+                FileRewriter.InsertTextAfter(D->getEndLoc(), formatv("public:virtual unsigned _refl_type_id(refl::detail::hierarchy_tag<{0}>)const noexcept{{return 0;}", rname).str());
+            else
+                FileRewriter.InsertTextAfter(D->getEndLoc(), formatv("public:unsigned _refl_type_id(refl::detail::hierarchy_tag<{0}>)const noexcept override{{return {1};}", rname, Id).str());
+
+            Specializations += formatv("template<>struct refl::hierarchy<{0}>{{static constexpr bool generated=true;using root={1};using derived={2};static constexpr unsigned id={3},last={4};",
+                                       qualified(D), rname, list(Derived_.lookup(D)), Id, Last[D]);
+            if (Id == 0)
+                Specializations += formatv("using types={0};", list(Order));
+            Specializations += "};";
+        }
+
+        if (auto Loc{specializationLoc(LastDecl, Context)}; Loc.isValid())
+            FileRewriter.InsertTextAfter(Loc, Specializations);
     }
+}
 
-    void EndSourceFileAction() override
-    {
-        if (FileRewriteError_)
-            return;
+// the cache line size the layout analysis assumes
+static constexpr int64_t ReflCacheLine = 64;
 
-        auto FileRewriteBuffer{FileRewriter_.getRewriteBufferFor(FileID_)};
+// Warns about the fields tagged with refl::concurrent sharing a cache line with
+// another field. The record is not known to start on a cache line unless it
+// is aligned to one, until then any two fields closer than a line may share one.
+static void checkConcurrentFields(const CXXRecordDecl* recordDecl, ReflAttrs* Attrs, ASTContext& Context)
+{
+    if (recordDecl->isDependentContext() || recordDecl->isInvalidDecl())
+        return;
+    if (std::none_of(recordDecl->field_begin(), recordDecl->field_end(), [Attrs](const FieldDecl* field) { return Attrs->concurrent(field); }))
+        return;
+
+    auto& Diags{Context.getDiagnostics()};
+    auto& SourceManager{Context.getSourceManager()};
+    const auto& Layout{Context.getASTRecordLayout(recordDecl)};
+    bool Aligned = Layout.getAlignment().getQuantity() >= ReflCacheLine;
 
-        compile(CI_, FileName_, FileRewriteBuffer->begin(), FileRewriteBuffer->end());
+    // the bytes of the fields, bit-fields included
+    struct Bytes {
+        const FieldDecl* Decl;
+        int64_t Begin;
+        int64_t End;
+    };
+    SmallVector<Bytes, 16> Fields;
+    for (const auto* Field : recordDecl->fields()) {
+        auto Bits  = static_cast<int64_t>(Layout.getFieldOffset(Field->getFieldIndex()));
+        auto Width = Field->isBitField()
+                         ? static_cast<int64_t>(Field->getBitWidth()->EvaluateKnownConstInt(Context).getZExtValue())
+                         : static_cast<int64_t>(Context.getTypeSize(Field->getType()));
+        if (Width != 0)
+            Fields.push_back({Field, Bits / 8, (Bits + Width + 7) / 8});
     }
+    auto share = [Aligned](const Bytes& a, const Bytes& b) {
+        if (Aligned)
+            return a.Begin / ReflCacheLine <= (b.End - 1) / ReflCacheLine && b.Begin / ReflCacheLine <= (a.End - 1) / ReflCacheLine;
+        return a.Begin < b.End + ReflCacheLine - 1 && b.Begin < a.End + ReflCacheLine - 1;
+    };
+    // the alignment specifier is placed after the name, where it is valid for
+    // every declarator
+    auto alignField = [&](const FieldDecl* Field) {
+        if (Field->isBitField() || Field->getLocation().isMacroID())
+            return FixItHint{};
+        auto Loc{Lexer::getLocForEndOfToken(Field->getLocation(), 0, SourceManager, Context.getLangOpts())};
+        return FixItHint::CreateInsertion(Loc, formatv(" alignas({0})", ReflCacheLine).str());
+    };
 
-private:
-    CompilerInstance* CI_;
+    for (size_t i = 0; i != Fields.size(); ++i) {
+        if (!Attrs->concurrent(Fields[i].Decl))
+            continue;
+        const FieldDecl *Before = nullptr, *After = nullptr;
+        for (size_t j = 0; j != Fields.size(); ++j) {
+            if (j == i || !share(Fields[i], Fields[j]))
+                continue;
+            if (j < i && !Before)
+                Before = Fields[j].Decl;
+            if (j > i && !After)
+                After = Fields[j].Decl;
+        }
+        if (!Before && !After)
+            continue;
+
+        const auto* Field = Fields[i].Decl;
+        Diags.Report(Field->getLocation(), Diags.getCustomDiagID(DiagnosticsEngine::Warning, "refl: '%0' is written concurrently, but shares a %1 byte cache line with '%2'"))
+            << Field->getName() << static_cast<unsigned>(ReflCacheLine) << (Before ? Before : After)->getName();
+        if (Before) {
+            Diags.Report(Field->getLocation(), Diags.getCustomDiagID(DiagnosticsEngine::Note, "add 'alignas(%0)' to start '%1' on a new cache line"))
+                << static_cast<unsigned>(ReflCacheLine) << Field->getName() << alignField(Field);
+        }
+        if (After) {
+            // the field right after it has to start the next line
+            const auto* Next = Fields[i + 1].Decl;
+            if (Next->isBitField()) {
+                Diags.Report(Field->getLocation(), Diags.getCustomDiagID(DiagnosticsEngine::Note, "add padding after '%0' up to the next %1 byte boundary"))
+                    << Field->getName() << static_cast<unsigned>(ReflCacheLine);
+            } else {
+                Diags.Report(Next->getLocation(), Diags.getCustomDiagID(DiagnosticsEngine::Note, "add 'alignas(%0)' to '%1' to move it to the next cache line"))
+                    << static_cast<unsigned>(ReflCacheLine) << Next->getName() << alignField(Next);
+            }
+        }
+    }
+}
 
-    std::string FileName_;
-    FileID FileID_;
-    Rewriter FileRewriter_;
-    bool FileRewriteError_ = false;
-};
+// Finds every reflected record and enum of the translation unit in a single
+// traversal and inserts their metadata into the files declaring them.
+class ReflVisitor : public RecursiveASTVisitor<ReflVisitor> {
+public:
+    ReflVisitor(ASTContext& Context, Rewriter* FileRewriter, ReflCache* Cache, ReflStats* Stats, ReflAttrs* Attrs, const ReflGenOptions& Gen, const DenseSet<const Decl*>* Demand)
+        : Context_(Context)
+        , FileRewriter_(FileRewriter)
+        , Cache_(Cache)
+        , Stats_(Stats)
+        , Attrs_(Attrs)
+        , Gen_(Gen)
+        , Demand_(Demand)
+    {
+    }
 
-bool ReflectAction::ParseArgs(CompilerInstance const&, std::vector<std::string> const&)
-{
+    bool TraverseDecl(Decl* D);
+    bool VisitCXXRecordDecl(CXXRecordDecl* recordDecl);
+    bool VisitEnumDecl(EnumDecl* enumDecl);
+
+    ReflHierarchies& hierarchies() { return Hierarchies_; }
+
+private:
+    ASTContext& Context_;
+    Rewriter* FileRewriter_;
+    ReflCache* Cache_;
+    ReflStats* Stats_;
+    ReflAttrs* Attrs_;
+    const ReflGenOptions& Gen_;
+    // types whose metadata is used, every type is generated when null
+    const DenseSet<const Decl*>* Demand_;
+    ReflHierarchies Hierarchies_;
+};
+
+// the metadata of the types loaded from a module or a precompiled header was
+// generated when it was built and is read back from it
+bool ReflVisitor::TraverseDecl(Decl* D)
+{
+    if (D && D->isFromASTFile())
+        return true;
+    return RecursiveASTVisitor::TraverseDecl(D);
+}
+
+bool ReflVisitor::VisitCXXRecordDecl(CXXRecordDecl* recordDecl)
+{
+    Hierarchies_.add(recordDecl, Attrs_);
+    if (!isReflected(recordDecl, Attrs_))
+        return true;
+    checkConcurrentFields(recordDecl, Attrs_, Context_);
+
+    if (Demand_ && !Demand_->contains(recordDecl->getCanonicalDecl())) {
+        FileRewriter_->InsertTextAfter(recordDecl->getEndLoc(), formatv("public:using _meta=refl::detail::lazy<{0}>;", recordDecl->getName()).str());
+        return true;
+    }
+
+    // the pool of a class template is declared in front of it, so the parts
+    // of the metadata that only refer to the pool are shared by every instantiation
+    SourceLocation TemplateLoc;
+    if (auto* Template = recordDecl->getDescribedClassTemplate())
+        TemplateLoc = Template->getBeginLoc();
+    else if (auto* Partial = dyn_cast<ClassTemplatePartialSpecializationDecl>(recordDecl))
+        TemplateLoc = Partial->getTemplateParameters()->getTemplateLoc();
+
+    if (TemplateLoc.isValid()) {
+        auto pool = formatv("_refl_pool_{0}_{1}", recordDecl->getName(), recordDecl->getODRHash()).str();
+        auto meta{cachedRecordMeta(Cache_, Stats_, Attrs_, recordDecl, Context_, "", false, pool, "_refl_bits", Gen_.Categories)};
+        FileRewriter_->InsertTextBefore(TemplateLoc, formatv("struct {2}{0}{{{1}};", pool, meta.pool, Gen_.Type).str());
+        FileRewriter_->InsertTextAfter(recordDecl->getEndLoc(), formatv("public:{0}using _meta={1};", bitsStruct("_refl_bits", meta.bits, Gen_.Type), meta.meta).str());
+        return true;
+    }
+
+    auto meta{cachedRecordMeta(Cache_, Stats_, Attrs_, recordDecl, Context_, "", false, "_refl_pool", "_refl_bits", Gen_.Categories)};
+    std::string ss = formatv("public:struct {2}_refl_pool{{{0}};{3}using _meta={1};", meta.pool, meta.meta, Gen_.Type,
+                             bitsStruct("_refl_bits", meta.bits, Gen_.Type));
+
+    FileRewriter_->InsertTextAfter(recordDecl->getEndLoc(), ss);
+    return true;
+}
+
+bool ReflVisitor::VisitEnumDecl(EnumDecl* enumDecl)
+{
+    if (!isReflected(enumDecl, Attrs_))
+        return true;
+
+    const auto& sname = enumDecl->getDeclName();
+    const auto& qname = enumDecl->getQualifiedNameAsString();
+    std::string ss;
+    if (Demand_ && !Demand_->contains(enumDecl->getCanonicalDecl())) {
+        // left incomplete, a base class would be instantiated right away
+        ss = formatv("template<>struct refl::meta<{0}>;", qname);
+    } else {
+        ss = formatv("template<>struct {2}refl::meta<{0}>:EnumType<{0},\"{1}\",\"{0}\">", qname, sname, Gen_.Type);
+        ss += cachedMeta(Cache_, Stats_, enumDecl, Context_, "", [&] { return generateEnumMeta(enumDecl, Gen_.Member); });
+    }
+
+    if (auto loc{specializationLoc(enumDecl, Context_)}; loc.isValid())
+        FileRewriter_->InsertTextAfter(loc, ss);
+    return true;
+}
+
+class ReflConsumer : public ASTConsumer {
+public:
+    ReflConsumer(Rewriter* FileRewriter, bool* FileRewriteError, ReflCache* Cache, ReflStats* Stats, ReflAttrs* Attrs, const ReflGenOptions& Gen, bool Lazy)
+        : FileRewriter_(FileRewriter)
+        , FileRewriteError_(FileRewriteError)
+        , Cache_(Cache)
+        , Stats_(Stats)
+        , Attrs_(Attrs)
+        , Gen_(Gen)
+        , Lazy_(Lazy)
+    {
+    }
+
+    void HandleTranslationUnit(ASTContext& Context) override;
+
+private:
+    Rewriter* FileRewriter_;
+    bool* FileRewriteError_;
+    ReflCache* Cache_;
+    ReflStats* Stats_;
+    ReflAttrs* Attrs_;
+    const ReflGenOptions& Gen_;
+    bool Lazy_;
+};
+
+void ReflConsumer::HandleTranslationUnit(ASTContext& Context)
+{
+    ReflTimer Timer{Stats_->TraversalTime, "refl traversal"};
+
+    std::optional<DenseSet<const Decl*>> Demand;
+    if (Lazy_)
+        Demand = findDemandedTypes(Context, Attrs_);
+
+    ReflVisitor Visitor(Context, FileRewriter_, Cache_, Stats_, Attrs_, Gen_, Demand ? &*Demand : nullptr);
+
+    try {
+        Visitor.TraverseDecl(Context.getTranslationUnitDecl());
+        Visitor.hierarchies().generate(Context, *FileRewriter_);
+        *FileRewriteError_ = false;
+    } catch (ReflError const& e) {
+        auto& Diags{Context.getDiagnostics()};
+
+        unsigned ID{Diags.getDiagnosticIDs()->getCustomDiagID(
+            DiagnosticIDs::Error, e.what()
+        )};
+
+        Diags.Report(e.where(), ID);
+
+        *FileRewriteError_ = true;
+    }
+}
+
+// Returns the location of the first reflected base or member of the record
+// that is not public, an invalid location when there is none.
+static SourceLocation nonPublicMemberLoc(const CXXRecordDecl* recordDecl, ReflAttrs* Attrs, unsigned Categories)
+{
+    auto spec  = Attrs->spec(recordDecl);
+    Categories = Attrs->categories(recordDecl, Categories);
+
+    if (Categories & ReflBases) {
+        for (const auto& it : recordDecl->bases()) {
+            if (it.getAccessSpecifier() != AccessSpecifier::AS_public)
+                return it.getBeginLoc();
+        }
+    }
+
+    for (const auto* decl : recordDecl->decls()) {
+        if (decl->isImplicit())
+            continue;
+        bool reflected = false;
+        if (const auto* ctor = dyn_cast<CXXConstructorDecl>(decl))
+            reflected = !ctor->isDeleted() && isReflectedMember(ctor, Attrs, spec, Categories, ReflConstructors);
+        else if (const auto* method = dyn_cast<CXXMethodDecl>(decl))
+            reflected = !isa<CXXDestructorDecl>(method) && !method->isDeleted() && isReflectedMember(method, Attrs, spec, Categories, ReflFunctions);
+        else if (const auto* field = dyn_cast<FieldDecl>(decl))
+            reflected = !field->isUnnamedBitField() && isReflectedMember(field, Attrs, spec, Categories, ReflVariables);
+        else if (isa<VarDecl>(decl))
+            reflected = isReflectedMember(decl, Attrs, spec, Categories, ReflVariables);
+        if (reflected && decl->getAccess() != AccessSpecifier::AS_public)
+            return decl->getLocation();
+    }
+    return {};
+}
+
+// Collects the metadata of the reflected types of every file for ReflEmitConsumer.
+class ReflEmitVisitor : public RecursiveASTVisitor<ReflEmitVisitor> {
+public:
+    ReflEmitVisitor(ASTContext& Context, ReflCache* Cache, ReflStats* Stats, ReflAttrs* Attrs, const ReflGenOptions& Gen)
+        : Context_(Context)
+        , Cache_(Cache)
+        , Stats_(Stats)
+        , Attrs_(Attrs)
+        , Gen_(Gen)
+    {
+    }
+
+    bool TraverseDecl(Decl* D);
+    bool VisitTagDecl(TagDecl* D);
+
+    std::map<FileID, std::string> const& files() const noexcept { return Files_; }
+
+private:
+    ASTContext& Context_;
+    ReflCache* Cache_;
+    ReflStats* Stats_;
+    ReflAttrs* Attrs_;
+    const ReflGenOptions& Gen_;
+    std::map<FileID, std::string> Files_;
+};
+
+bool ReflEmitVisitor::TraverseDecl(Decl* D)
+{
+    if (D && D->isFromASTFile())
+        return true;
+    return RecursiveASTVisitor::TraverseDecl(D);
+}
+
+bool ReflEmitVisitor::VisitTagDecl(TagDecl* D)
+{
+    // the classes can not be changed, nothing could return their number
+    if (auto recordDecl = dyn_cast<CXXRecordDecl>(D); recordDecl && recordDecl->isThisDeclarationADefinition() && Attrs_->closed(recordDecl))
+        throw ReflError{"refl: closed hierarchies can not be used in emit mode", D};
+    if (!isReflected(D, Attrs_))
+        return true;
+
+    if (D->isDependentContext())
+        throw ReflError{"refl: class templates can not be reflected in emit mode", D};
+    if (D->getParentFunctionOrMethod())
+        throw ReflError{"refl: local types can not be reflected in emit mode", D};
+    if (D->isInAnonymousNamespace())
+        throw ReflError{"refl: types in anonymous namespaces can not be reflected in emit mode", D};
+    for (const Decl* it = D; it->getDeclContext()->isRecord(); it = cast<Decl>(it->getDeclContext())) {
+        if (it->getAccess() != AccessSpecifier::AS_public)
+            throw ReflError{"refl: non-public nested types can not be reflected in emit mode", D};
+    }
+
+    auto& SourceManager{Context_.getSourceManager()};
+    auto& ss{Files_[SourceManager.getFileID(SourceManager.getExpansionLoc(D->getBeginLoc()))]};
+
+    if (auto recordDecl = dyn_cast<CXXRecordDecl>(D)) {
+        // the metadata is included by every translation unit using the type,
+        // where only the public members can be named
+        if (auto Loc{nonPublicMemberLoc(recordDecl, Attrs_, Gen_.Categories)}; Loc.isValid())
+            throw ReflError{"refl: only public bases and members can be reflected in emit mode", Loc};
+        checkConcurrentFields(recordDecl, Attrs_, Context_);
+        auto tname = typeName(Context_.getRecordType(recordDecl), Context_, true);
+        auto pool  = formatv("refl::detail::pool<{0}>", tname).str();
+        auto bits  = formatv("refl::detail::bit_access<{0}>", tname).str();
+        auto meta{cachedRecordMeta(Cache_, Stats_, Attrs_, recordDecl, Context_, "qualified", true, pool, bits, Gen_.Categories)};
+        ss += formatv("template<>struct {2}{0}{{{1}};\n", pool, meta.pool, Gen_.Type);
+        if (!meta.bits.empty())
+            ss += formatv("template<>struct {2}{0}{{{1}};\n", bits, meta.bits, Gen_.Type);
+        ss += formatv("template<>struct {2}refl::meta<{0}>:{1}{{};\n", tname, meta.meta, Gen_.Type);
+    } else if (auto enumDecl = dyn_cast<EnumDecl>(D)) {
+        const auto& qname = enumDecl->getQualifiedNameAsString();
+        ss += formatv("template<>struct {2}refl::meta<{0}>:refl::EnumType<{0},\"{1}\",\"{0}\">", qname, enumDecl->getDeclName(), Gen_.Type);
+        ss += cachedMeta(Cache_, Stats_, enumDecl, Context_, "", [&] { return generateEnumMeta(enumDecl, Gen_.Member); });
+        ss += '\n';
+    }
     return true;
 }
 
+// Returns the path of File relative to Root, or the path without its root
+// name and directory when File is outside of Root. Both are absolute.
+static std::string relativePath(StringRef File, StringRef Root)
+{
+    auto FileIt{sys::path::begin(File)};
+    auto FileEnd{sys::path::end(File)};
+    for (auto RootIt{sys::path::begin(Root)}, RootEnd{sys::path::end(Root)}; RootIt != RootEnd; ++RootIt, ++FileIt) {
+        if (FileIt == FileEnd || *FileIt != *RootIt)
+            return sys::path::relative_path(File).str();
+    }
+
+    SmallString<128> Relative;
+    for (; FileIt != FileEnd; ++FileIt)
+        sys::path::append(Relative, *FileIt);
+    return Relative.str().str();
+}
+
+// Names the outputs of a source file by its path relative to Root, with '/'
+// separators, so the files of the same name in different directories or with
+// different extensions get their own outputs.
+static std::string outputName(SourceManager& SourceManager, FileEntryRef Entry, StringRef Root)
+{
+    SmallString<256> Source{Entry.getName()};
+    SourceManager.getFileManager().makeAbsolutePath(Source);
+    sys::path::remove_dots(Source, true);
+    return sys::path::convert_to_slash(relativePath(Source, Root));
+}
+
+// Writes the metadata of the reflected types declared in each file to
+// '<path>.refl.hpp' in the emit directory, where path is the path of the file
+// relative to the emit root, so it can be compiled without the plugin. Files
+// are only touched when their content changes.
+class ReflEmitConsumer : public ASTConsumer {
+public:
+    ReflEmitConsumer(std::string Dir, std::string Root, ReflCache* Cache, ReflStats* Stats, ReflAttrs* Attrs, const ReflGenOptions& Gen)
+        : Dir_(std::move(Dir))
+        , Root_(std::move(Root))
+        , Cache_(Cache)
+        , Stats_(Stats)
+        , Attrs_(Attrs)
+        , Gen_(Gen)
+    {
+    }
+
+    void HandleTranslationUnit(ASTContext& Context) override;
+
+private:
+    std::string Dir_;
+    std::string Root_;
+    ReflCache* Cache_;
+    ReflStats* Stats_;
+    ReflAttrs* Attrs_;
+    const ReflGenOptions& Gen_;
+};
+
+void ReflEmitConsumer::HandleTranslationUnit(ASTContext& Context)
+{
+    auto& SourceManager{Context.getSourceManager()};
+    auto& Diags{Context.getDiagnostics()};
+    ReflEmitVisitor Visitor(Context, Cache_, Stats_, Attrs_, Gen_);
+
+    try {
+        ReflTimer Timer{Stats_->TraversalTime, "refl traversal"};
+        Visitor.TraverseDecl(Context.getTranslationUnitDecl());
+    } catch (ReflError const& e) {
+        unsigned ID{Diags.getDiagnosticIDs()->getCustomDiagID(
+            DiagnosticIDs::Error, e.what()
+        )};
+
+        Diags.Report(e.where(), ID);
+        return;
+    }
+
+    ReflTimer Timer{Stats_->RewriteTime, "refl write"};
+    for (auto& [ID, Meta] : Visitor.files()) {
+        auto Entry{SourceManager.getFileEntryRefForID(ID)};
+        if (!Entry)
+            continue;
+
+        auto Name{outputName(SourceManager, *Entry, Root_)};
+
+        // only the relative path is written, the output does not depend on the build directory
+        std::string Content = formatv("// Generated by refl-plugin from {0}, do not edit.\n"
+                                      "#pragma once\n#include <refl/refl.hpp>\n\n{1}",
+                                      Name, Meta);
+
+        SmallString<128> Path{Dir_};
+        sys::path::append(Path, Name + ".refl.hpp");
+        if (auto EC{sys::fs::create_directories(sys::path::parent_path(Path))}) {
+            Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Error, "refl: cannot create directory '%0': %1"))
+                << sys::path::parent_path(Path) << EC.message();
+            continue;
+        }
+
+        if (auto Buffer{MemoryBuffer::getFile(Path)}; Buffer && (*Buffer)->getBuffer() == Content)
+            continue;
+        if (auto Err{writeToOutput(Path, [&Content](raw_ostream& OS) {
+                OS << Content;
+                return Error::success();
+            })}) {
+            Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Error, "refl: cannot write '%0': %1"))
+                << Path.str() << toString(std::move(Err));
+        }
+    }
+}
+
+// Restores the access checks suspended by ReflInjectConsumer once the parser
+// reaches the '_Pragma("refl inject_end")' closing an injected token stream.
+class ReflPragmaHandler : public PragmaHandler {
+public:
+    ReflPragmaHandler(LangOptions& LangOpts, unsigned* Suspended, bool* AccessControl)
+        : PragmaHandler("refl")
+        , LangOpts_(LangOpts)
+        , Suspended_(Suspended)
+        , AccessControl_(AccessControl)
+    {
+    }
+
+    void HandlePragma(Preprocessor& PP, PragmaIntroducer, Token&) override;
+
+private:
+    LangOptions& LangOpts_;
+    unsigned* Suspended_;
+    bool* AccessControl_;
+};
+
+void ReflPragmaHandler::HandlePragma(Preprocessor& PP, PragmaIntroducer, Token&)
+{
+    Token Tok;
+    do {
+        PP.Lex(Tok);
+    } while (Tok.isNot(tok::eod));
+
+    if (*Suspended_ > 0 && --*Suspended_ == 0)
+        LangOpts_.AccessControl = *AccessControl_;
+}
+
+// Generates the metadata as soon as the definition of a reflected type is
+// finished and feeds it back to the parser right after the closing ';'.
+// The metadata is declared next to the type as 'refl_meta(T*)' and found
+// through ADL by refl::meta, so the class itself is left untouched.
+class ReflInjectConsumer : public ASTConsumer {
+public:
+    ReflInjectConsumer(CompilerInstance& CI, ReflCache* Cache, ReflStats* Stats, ReflAttrs* Attrs, const ReflGenOptions& Gen)
+        : CI_(CI)
+        , Cache_(Cache)
+        , Stats_(Stats)
+        , Attrs_(Attrs)
+        , Gen_(Gen)
+    {
+        CI.getPreprocessor().AddPragmaHandler(
+            new ReflPragmaHandler(CI.getLangOpts(), &Suspended_, &AccessControl_)
+        );
+    }
+
+    void HandleTagDeclDefinition(TagDecl* D) override;
+
+private:
+    void inject(const TagDecl* D, std::string const& Text);
+
+    CompilerInstance& CI_;
+    ReflCache* Cache_;
+    ReflStats* Stats_;
+    ReflAttrs* Attrs_;
+    const ReflGenOptions& Gen_;
+    unsigned Suspended_ = 0;
+    bool AccessControl_ = true;
+};
+
+void ReflInjectConsumer::HandleTagDeclDefinition(TagDecl* D)
+{
+    auto& Context{CI_.getASTContext()};
+    try {
+        // nothing can be added to the classes in inject mode
+        if (auto recordDecl = dyn_cast<CXXRecordDecl>(D); recordDecl && Attrs_->closed(recordDecl))
+            throw ReflError{"refl: closed hierarchies can not be used in inject mode", D};
+
+        auto spec = Attrs_->spec(D);
+        if (spec != ReflSpec::all && spec != ReflSpec::none)
+            return;
+
+        // instantiations of reflected templates are reported as well
+        if (auto recordDecl = dyn_cast<CXXRecordDecl>(D);
+            recordDecl && isTemplateInstantiation(recordDecl->getTemplateSpecializationKind()))
+            return;
+        if (auto enumDecl = dyn_cast<EnumDecl>(D);
+            enumDecl && isTemplateInstantiation(enumDecl->getTemplateSpecializationKind()))
+            return;
+        if (D->isDependentContext())
+            throw ReflError{"refl: class templates can not be reflected in inject mode", D};
+        if (D->getParentFunctionOrMethod())
+            throw ReflError{"refl: local types can not be reflected in inject mode", D};
+
+        // refl::meta<T> must not be instantiated before the metadata is declared
+        if (auto Meta = findMetaTemplate(Context)) {
+            void* InsertPos = nullptr;
+            TemplateArgument Arg{Context.getTypeDeclType(D)};
+            if (Meta->findSpecialization(Arg, InsertPos))
+                throw ReflError{"refl: reflection was used before the definition of the type was complete", D};
+        }
+
+        // at class scope the declaration has to be a friend to be visible through ADL
+        const char* Friend = D->getDeclContext()->isRecord() ? "friend " : "";
+        const auto& sname  = D->getDeclName();
+
+        if (auto recordDecl = dyn_cast<CXXRecordDecl>(D)) {
+            checkConcurrentFields(recordDecl, Attrs_, Context);
+            // the accessors of a type nested in a class are parsed once the
+            // outermost class is complete, after the access checks are restored
+            if (*Friend) {
+                for (const auto* field : recordDecl->fields()) {
+                    if (field->isBitField() && field->getAccess() != AccessSpecifier::AS_public)
+                        throw ReflError{"refl: non-public bit-fields of nested types can not be reflected in inject mode", field};
+                }
+            }
+            auto pool = formatv("refl_pool_{0}", sname).str();
+            auto bits = formatv("refl_bits_{0}", sname).str();
+            auto meta{cachedRecordMeta(Cache_, Stats_, Attrs_, recordDecl, Context, "inject", false, pool, bits, Gen_.Categories)};
+            inject(D, formatv("struct {5}{0}{{{1}};{6}{2}{3} refl_meta({4}*);", pool, meta.pool, Friend, meta.meta, sname, Gen_.Type,
+                              bitsStruct(bits, meta.bits, Gen_.Type)));
+        } else if (auto enumDecl = dyn_cast<EnumDecl>(D)) {
+            const auto& qname = enumDecl->getQualifiedNameAsString();
+            std::string ss = formatv("struct {2}refl_meta_{1}:refl::EnumType<{0},\"{1}\",\"{0}\">", qname, sname, Gen_.Type);
+            ss += cachedMeta(Cache_, Stats_, enumDecl, Context, "", [&] { return generateEnumMeta(enumDecl, Gen_.Member); });
+            ss += formatv("{0}refl_meta_{1} refl_meta({2}*);", Friend, sname, qname);
+            inject(D, ss);
+        }
+    } catch (ReflError const& e) {
+        auto& Diags{Context.getDiagnostics()};
+
+        unsigned ID{Diags.getDiagnosticIDs()->getCustomDiagID(
+            DiagnosticIDs::Error, e.what()
+        )};
+
+        Diags.Report(e.where(), ID);
+    }
+}
+
+void ReflInjectConsumer::inject(const TagDecl* D, std::string const& Text)
+{
+    auto& SourceManager{CI_.getSourceManager()};
+    auto& PP{CI_.getPreprocessor()};
+    auto& LangOpts{CI_.getLangOpts()};
+
+    // the parser has already read the token following the closing brace, the
+    // injected tokens can only be placed after it when it is the terminating ';'
+    auto End{D->getBraceRange().getEnd()};
+    auto Semi{Lexer::findNextToken(End, SourceManager, LangOpts)};
+    if (End.isMacroID() || !Semi || Semi->isNot(tok::semi))
+        throw ReflError{"refl: reflected types must be terminated by ';' in inject mode", D};
+
+    // the generated code gets its own (system) file so diagnostics point to it
+    // without repeating warnings about it
+    auto Buffer{MemoryBuffer::getMemBufferCopy(
+        Text + "_Pragma(\"refl inject_end\")\n", "<refl-meta>"
+    )};
+    auto ID{SourceManager.createFileID(std::move(Buffer), SrcMgr::C_System, 0, 0, Semi->getEndLoc())};
+
+    Lexer RawLexer{ID, SourceManager.getBufferOrFake(ID), SourceManager, LangOpts};
+    std::vector<Token> Tokens;
+    Token Tok;
+    RawLexer.LexFromRawLexer(Tok);
+    while (Tok.isNot(tok::eof)) {
+        if (Tok.is(tok::raw_identifier))
+            PP.LookUpIdentifierInfo(Tok);
+        Tokens.push_back(Tok);
+        RawLexer.LexFromRawLexer(Tok);
+    }
+
+    // the generated code names private members, it is checked as if it were
+    // part of the class
+    if (Suspended_++ == 0) {
+        AccessControl_          = LangOpts.AccessControl;
+        LangOpts.AccessControl = false;
+    }
+
+    auto Stream{std::make_unique<Token[]>(Tokens.size())};
+    std::copy(Tokens.begin(), Tokens.end(), Stream.get());
+    PP.EnterTokenStream(std::move(Stream), static_cast<unsigned>(Tokens.size()), false, false);
+}
+
+// The layout of a reflected record, as reported by the 'layout' plugin argument.
+// Sizes and offsets are in bytes.
+struct ReflRecordLayout {
+    struct Field {
+        const FieldDecl* Decl;
+        int64_t Offset;
+        int64_t Size;
+        int64_t Alignment;
+    };
+
+    int64_t Size      = 0;
+    int64_t Alignment = 0;
+    // the bytes not used by the fields, the bases or the virtual table pointer
+    int64_t Padding = 0;
+    SmallVector<Field, 16> Fields;
+    // the fields that don't fit in a cache line but could
+    SmallVector<Field, 4> Straddling;
+    // a field order making the record smaller, empty when there is none
+    SmallVector<Field, 16> Proposed;
+    int64_t ProposedSize = 0;
+};
+
+static ReflRecordLayout analyzeLayout(const CXXRecordDecl* recordDecl, ASTContext& Context)
+{
+    const auto& Layout{Context.getASTRecordLayout(recordDecl)};
+    ReflRecordLayout Result;
+    Result.Size      = Layout.getSize().getQuantity();
+    Result.Alignment = Layout.getAlignment().getQuantity();
+
+    std::vector<bool> Used(static_cast<size_t>(Result.Size));
+    auto use = [&](int64_t Begin, int64_t Length) {
+        for (auto i = Begin; i < std::min(Begin + Length, Result.Size); ++i)
+            Used[static_cast<size_t>(i)] = true;
+    };
+
+    if (Layout.hasOwnVFPtr())
+        use(0, Context.toCharUnitsFromBits(static_cast<int64_t>(Context.getTargetInfo().getPointerWidth(LangAS::Default))).getQuantity());
+    for (const auto& Base : recordDecl->bases()) {
+        const auto* BaseDecl = Base.getType()->getAsCXXRecordDecl();
+        if (BaseDecl && !Base.isVirtual() && !BaseDecl->isEmpty())
+            use(Layout.getBaseClassOffset(BaseDecl).getQuantity(), Context.getASTRecordLayout(BaseDecl).getDataSize().getQuantity());
+    }
+    for (const auto& Base : recordDecl->vbases()) {
+        const auto* BaseDecl = Base.getType()->getAsCXXRecordDecl();
+        if (BaseDecl && !BaseDecl->isEmpty())
+            use(Layout.getVBaseClassOffset(BaseDecl).getQuantity(), Context.getASTRecordLayout(BaseDecl).getDataSize().getQuantity());
+    }
+
+    // bit-fields, overlapping fields and packed records keep their order
+    bool Reorderable = !recordDecl->hasAttr<PackedAttr>() && recordDecl->getNumVBases() == 0;
+    for (const auto* Field : recordDecl->fields()) {
+        auto Bits = static_cast<int64_t>(Layout.getFieldOffset(Field->getFieldIndex()));
+        if (Field->isBitField()) {
+            auto Width = static_cast<int64_t>(Field->getBitWidth()->EvaluateKnownConstInt(Context).getZExtValue());
+            use(Bits / 8, (Bits % 8 + Width + 7) / 8);
+            Reorderable = false;
+            continue;
+        }
+        if (Field->isZeroSize(Context) || Field->hasAttr<NoUniqueAddressAttr>())
+            Reorderable = false;
+
+        ReflRecordLayout::Field Info{Field, Context.toCharUnitsFromBits(Bits).getQuantity(),
+                                     Context.getTypeSizeInChars(Field->getType()).getQuantity(),
+                                     Context.getDeclAlign(Field).getQuantity()};
+        use(Info.Offset, Info.Size);
+        if (Info.Size > 1 && Info.Size <= ReflCacheLine && Info.Offset / ReflCacheLine != (Info.Offset + Info.Size - 1) / ReflCacheLine)
+            Result.Straddling.push_back(Info);
+        Result.Fields.push_back(Info);
+    }
+    Result.Padding = std::count(Used.begin(), Used.end(), false);
+
+    // placing the fields by decreasing alignment leaves the least padding
+    if (Reorderable && Result.Fields.size() > 1) {
+        auto Order{Result.Fields};
+        std::stable_sort(Order.begin(), Order.end(), [](const auto& a, const auto& b) {
+            return a.Alignment != b.Alignment ? a.Alignment > b.Alignment : a.Size > b.Size;
+        });
+        auto Offset = Result.Fields.front().Offset;
+        for (auto& Field : Order) {
+            Offset       = static_cast<int64_t>(alignTo(static_cast<uint64_t>(Offset), static_cast<uint64_t>(Field.Alignment)));
+            Field.Offset = Offset;
+            Offset += Field.Size;
+        }
+        auto Size = static_cast<int64_t>(alignTo(static_cast<uint64_t>(Offset), static_cast<uint64_t>(Result.Alignment)));
+        if (Size < Result.Size) {
+            Result.Proposed     = std::move(Order);
+            Result.ProposedSize = Size;
+        }
+    }
+    return Result;
+}
+
+// Reports the reflected records that a different field order would make
+// smaller and their fields straddling a cache line. With a report directory
+// the layout of every reflected record is written to
+// '<main file>.layout.json' in it as well.
+class ReflLayoutVisitor : public RecursiveASTVisitor<ReflLayoutVisitor> {
+public:
+    ReflLayoutVisitor(ASTContext& Context, ReflAttrs* Attrs)
+        : Context_(Context)
+        , Attrs_(Attrs)
+    {
+    }
+
+    bool TraverseDecl(Decl* D);
+    bool VisitCXXRecordDecl(CXXRecordDecl* recordDecl);
+
+    json::Array& records() { return Records_; }
+
+private:
+    ASTContext& Context_;
+    ReflAttrs* Attrs_;
+    json::Array Records_;
+};
+
+bool ReflLayoutVisitor::TraverseDecl(Decl* D)
+{
+    if (D && D->isFromASTFile())
+        return true;
+    return RecursiveASTVisitor::TraverseDecl(D);
+}
+
+bool ReflLayoutVisitor::VisitCXXRecordDecl(CXXRecordDecl* recordDecl)
+{
+    // class templates have no layout before they are instantiated
+    if (!isReflected(recordDecl, Attrs_) || recordDecl->isDependentContext() || recordDecl->isInvalidDecl())
+        return true;
+
+    auto& Diags{Context_.getDiagnostics()};
+    auto& SourceManager{Context_.getSourceManager()};
+    auto Layout{analyzeLayout(recordDecl, Context_)};
+    auto qname = recordDecl->getQualifiedNameAsString();
+
+    auto fieldNames = [](ArrayRef<ReflRecordLayout::Field> Fields) {
+        std::string Names;
+        for (const auto& Field : Fields) {
+            if (!Names.empty())
+                Names += ", ";
+            Names += Field.Decl->getName();
+        }
+        return Names;
+    };
+
+    if (!Layout.Proposed.empty()) {
+        Diags.Report(recordDecl->getLocation(), Diags.getCustomDiagID(DiagnosticsEngine::Warning, "refl: '%0' has %1 bytes of padding, ordering its fields as '%2' makes it %3 bytes instead of %4"))
+            << qname << static_cast<unsigned>(Layout.Padding) << fieldNames(Layout.Proposed)
+            << static_cast<unsigned>(Layout.ProposedSize) << static_cast<unsigned>(Layout.Size);
+    }
+    for (const auto& Field : Layout.Straddling) {
+        Diags.Report(Field.Decl->getLocation(), Diags.getCustomDiagID(DiagnosticsEngine::Warning, "refl: '%0' at offset %1 straddles a %2 byte cache line"))
+            << Field.Decl->getName() << static_cast<unsigned>(Field.Offset) << static_cast<unsigned>(ReflCacheLine);
+    }
+
+    auto fieldArray = [](ArrayRef<ReflRecordLayout::Field> Fields) {
+        json::Array Array;
+        for (const auto& Field : Fields) {
+            Array.push_back(json::Object{
+                {"name", Field.Decl->getName()},
+                {"offset", Field.Offset},
+                {"size", Field.Size},
+                {"alignment", Field.Alignment}
+            });
+        }
+        return Array;
+    };
+
+    auto Loc{SourceManager.getPresumedLoc(recordDecl->getLocation())};
+    json::Object Record{
+        {"name", qname},
+        {"location", Loc.isValid() ? formatv("{0}:{1}", Loc.getFilename(), Loc.getLine()).str() : std::string{}},
+        {"size", Layout.Size},
+        {"alignment", Layout.Alignment},
+        {"padding", Layout.Padding},
+        {"fields", fieldArray(Layout.Fields)},
+        {"straddling", fieldArray(Layout.Straddling)}
+    };
+    if (!Layout.Proposed.empty())
+        Record["proposed"] = json::Object{{"size", Layout.ProposedSize}, {"fields", fieldArray(Layout.Proposed)}};
+    Records_.push_back(std::move(Record));
+    return true;
+}
+
+class ReflLayoutConsumer : public ASTConsumer {
+public:
+    ReflLayoutConsumer(std::string Dir, std::string Root, ReflAttrs* Attrs)
+        : Dir_(std::move(Dir))
+        , Root_(std::move(Root))
+        , Attrs_(Attrs)
+    {
+    }
+
+    void HandleTranslationUnit(ASTContext& Context) override;
+
+private:
+    // the directory of the JSON reports, empty when they are not written
+    std::string Dir_;
+    // the reports are named by the path of the sources relative to it
+    std::string Root_;
+    ReflAttrs* Attrs_;
+};
+
+void ReflLayoutConsumer::HandleTranslationUnit(ASTContext& Context)
+{
+    ReflLayoutVisitor Visitor(Context, Attrs_);
+    Visitor.TraverseDecl(Context.getTranslationUnitDecl());
+
+    auto& SourceManager{Context.getSourceManager()};
+    auto Entry{SourceManager.getFileEntryRefForID(SourceManager.getMainFileID())};
+    if (Dir_.empty() || !Entry)
+        return;
+
+    SmallString<128> Path{Dir_};
+    sys::path::append(Path, outputName(SourceManager, *Entry, Root_) + ".layout.json");
+    if (auto EC{sys::fs::create_directories(sys::path::parent_path(Path))}) {
+        auto& Diags{Context.getDiagnostics()};
+        Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Error, "refl: cannot create directory '%0': %1"))
+            << sys::path::parent_path(Path) << EC.message();
+        return;
+    }
+    json::Value Report{json::Object{{"file", Entry->getName()}, {"records", std::move(Visitor.records())}}};
+    if (auto Err{writeToOutput(Path, [&Report](raw_ostream& OS) {
+            OS << formatv("{0:2}", Report) << '\n';
+            return Error::success();
+        })}) {
+        auto& Diags{Context.getDiagnostics()};
+        Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Error, "refl: cannot write '%0': %1"))
+            << Path.str() << toString(std::move(Err));
+    }
+}
+
+// Makes the protected hooks of the action requested on the command line
+// available to ReflectAction, which drives it next to its own consumer.
+class ReflMainAction : public WrapperFrontendAction {
+public:
+    using WrapperFrontendAction::WrapperFrontendAction;
+
+    using WrapperFrontendAction::BeginInvocation;
+    using WrapperFrontendAction::BeginSourceFileAction;
+    using WrapperFrontendAction::CreateASTConsumer;
+    using WrapperFrontendAction::EndSourceFileAction;
+    using WrapperFrontendAction::PrepareToExecuteAction;
+
+    ~ReflMainAction() override;
+};
+
+ReflMainAction::~ReflMainAction() = default;
+
+struct ReflOptions {
+    // generate the metadata during the original parse instead of rewriting
+    // the file and compiling it a second time
+    bool Inject = false;
+    // directory of the metadata cache, empty when the cache is not used
+    std::string CacheDir;
+    // write the metadata to headers in this directory instead of compiling it
+    std::string EmitDir;
+    // the headers and the layout reports are named by the path of the sources
+    // relative to this directory, the working directory by default
+    std::string EmitRoot;
+    // only parse the sources while emitting and leave the output empty, for
+    // build steps that don't need the objects
+    bool EmitOnly = false;
+    // only generate the metadata of the types whose reflection is used in the
+    // translation unit, the others get a stub
+    bool Lazy = false;
+    // report statistics at the end of the translation unit
+    bool Stats = false;
+    // leave the generated metadata out of the debug info
+    bool NoDebug = false;
+    // give the generated metadata hidden visibility
+    bool Hidden = false;
+    // report the padding and the cache line use of the reflected records
+    bool Layout = false;
+    // write the layout of the reflected records to JSON files in this directory
+    std::string LayoutDir;
+};
+
+class ReflectAction : public PluginASTAction {
+protected:
+    // the PCH and module actions set up the compiler instance in these hooks
+    bool PrepareToExecuteAction(CompilerInstance& CI) override
+    {
+        if (MainAction_)
+            return MainAction_->PrepareToExecuteAction(CI);
+        return PluginASTAction::PrepareToExecuteAction(CI);
+    }
+
+    bool BeginInvocation(CompilerInstance& CI) override
+    {
+        if (!MainAction_)
+            return PluginASTAction::BeginInvocation(CI);
+        MainAction_->setCurrentInput(getCurrentInput());
+        MainAction_->setCompilerInstance(&CI);
+        return MainAction_->BeginInvocation(CI);
+    }
+
+    bool BeginSourceFileAction(CompilerInstance& CI) override
+    {
+        // the parse generating the metadata sees the uses of the closed
+        // hierarchies before their ids exist, see refl::closed
+        if (!MainAction_) {
+            auto& PP{CI.getPreprocessor()};
+            PP.setPredefines(PP.getPredefines() + "#define REFL_DETAIL_GENERATING 1\n");
+            return true;
+        }
+
+        // lets the sources skip the generated headers while they are being written
+        if (!Options_.EmitDir.empty()) {
+            auto& PP{CI.getPreprocessor()};
+            PP.setPredefines(PP.getPredefines() + "#define REFL_EMIT 1\n");
+        }
+
+        MainAction_->setCurrentInput(getCurrentInput());
+        return MainAction_->BeginSourceFileAction(CI);
+    }
+
+    std::unique_ptr<ASTConsumer>
+    CreateASTConsumer(CompilerInstance& CI, StringRef FileName) override
+    {
+        CI_ = &CI;
+
+        // the enum bodies are cached with their attributes, the records with the categories
+        if (Cache_)
+            Cache_->setOptionsHash(formatv("{0}{1}{2}", CI.getInvocation().getModuleHash(), Gen_.Member, Gen_.Categories).str());
+
+        if (MainAction_) {
+            auto MainConsumer{MainAction_->CreateASTConsumer(CI, FileName)};
+            if (!MainConsumer)
+                return nullptr;
+
+            std::vector<std::unique_ptr<ASTConsumer>> Consumers;
+            if (Options_.Layout)
+                Consumers.push_back(std::make_unique<ReflLayoutConsumer>(Options_.LayoutDir, Options_.EmitRoot, &Attrs_));
+            if (Options_.Inject)
+                Consumers.push_back(std::make_unique<ReflInjectConsumer>(CI, Cache_.get(), &Stats_, &Attrs_, Gen_));
+            else
+                Consumers.push_back(std::make_unique<ReflEmitConsumer>(Options_.EmitDir, Options_.EmitRoot, Cache_.get(), &Stats_, &Attrs_, Gen_));
+            Consumers.push_back(std::move(MainConsumer));
+            return std::make_unique<MultiplexConsumer>(std::move(Consumers));
+        }
+
+        auto& SourceManager{CI.getSourceManager()};
+        auto& LangOpts{CI.getLangOpts()};
+
+        FileRewriter_.setSourceMgr(SourceManager, LangOpts);
+
+        auto Consumer{std::make_unique<ReflConsumer>(&FileRewriter_, &FileRewriteError_, Cache_.get(), &Stats_, &Attrs_, Gen_, Options_.Lazy)};
+        if (!Options_.Layout)
+            return Consumer;
+
+        std::vector<std::unique_ptr<ASTConsumer>> Consumers;
+        Consumers.push_back(std::make_unique<ReflLayoutConsumer>(Options_.LayoutDir, Options_.EmitRoot, &Attrs_));
+        Consumers.push_back(std::move(Consumer));
+        return std::make_unique<MultiplexConsumer>(std::move(Consumers));
+    }
+
+    bool ParseArgs(CompilerInstance const&, std::vector<std::string> const&) override;
+
+    // PCH and module builds parse an incomplete translation unit
+    TranslationUnitKind getTranslationUnitKind() override
+    {
+        if (MainAction_)
+            return MainAction_->getTranslationUnitKind();
+        return PluginASTAction::getTranslationUnitKind();
+    }
+
+    PluginASTAction::ActionType getActionType() override
+    {
+        return PluginASTAction::ReplaceAction;
+    }
+
+    void EndSourceFileAction() override
+    {
+        if (MainAction_)
+            MainAction_->EndSourceFileAction();
+        else if (!FileRewriteError_)
+            recompile();
+
+        if (Options_.EmitOnly)
+            writeEmptyOutput();
+
+        if (Options_.Stats)
+            reportStats();
+    }
+
+private:
+    void recompile();
+    void reportStats();
+    void writeEmptyOutput();
+
+    ReflOptions Options_;
+    ReflGenOptions Gen_;
+    std::unique_ptr<ReflMainAction> MainAction_;
+    std::unique_ptr<ReflCache> Cache_;
+    ReflStats Stats_;
+    ReflAttrs Attrs_;
+
+    CompilerInstance* CI_;
+
+    Rewriter FileRewriter_;
+    bool FileRewriteError_ = false;
+};
+
+bool ReflectAction::ParseArgs(CompilerInstance const& CI, std::vector<std::string> const& Args)
+{
+    for (const auto& Arg : Args) {
+        if (Arg == "inject") {
+            Options_.Inject = true;
+        } else if (Arg == "lazy") {
+            Options_.Lazy = true;
+        } else if (Arg == "stats") {
+            Options_.Stats = true;
+        } else if (Arg == "nodebug") {
+            Options_.NoDebug = true;
+        } else if (Arg == "hidden") {
+            Options_.Hidden = true;
+        } else if (Arg == "layout") {
+            Options_.Layout = true;
+        } else if (StringRef(Arg).starts_with("layout-report=")) {
+            Options_.Layout    = true;
+            Options_.LayoutDir = Arg.substr(14);
+        } else if (StringRef(Arg).starts_with("categories=")) {
+            auto Categories{parseCategories(StringRef(Arg).substr(11))};
+            if (!Categories || !*Categories) {
+                auto& Diags{CI.getDiagnostics()};
+                Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Error, "refl: invalid categories '%0', expected a list of bases, functions, variables and constructors"))
+                    << Arg.substr(11);
+                return false;
+            }
+            Gen_.Categories = *Categories;
+        } else if (StringRef(Arg).starts_with("cache=")) {
+            Options_.CacheDir = Arg.substr(6);
+        } else if (StringRef(Arg).starts_with("emit=")) {
+            Options_.EmitDir = Arg.substr(5);
+        } else if (StringRef(Arg).starts_with("emit-root=")) {
+            Options_.EmitRoot = Arg.substr(10);
+        } else if (Arg == "emit-only") {
+            Options_.EmitOnly = true;
+        } else {
+            auto& Diags{CI.getDiagnostics()};
+            Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Error, "refl: unknown plugin argument '%0'"))
+                << Arg;
+            return false;
+        }
+    }
+
+    if (Options_.Inject + !Options_.EmitDir.empty() + Options_.Lazy > 1) {
+        auto& Diags{CI.getDiagnostics()};
+        Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Error, "refl: only one of 'inject', 'emit' and 'lazy' can be used"));
+        return false;
+    }
+    if (Options_.EmitOnly && Options_.EmitDir.empty()) {
+        auto& Diags{CI.getDiagnostics()};
+        Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Error, "refl: 'emit-only' requires 'emit'"));
+        return false;
+    }
+
+    if (Options_.NoDebug)
+        Gen_.Member = "[[gnu::nodebug]]";
+    // there is no hidden visibility in PE/COFF, the metadata is not exported anyway
+    if (Options_.Hidden && !Triple(CI.getTargetOpts().Triple).isOSWindows())
+        Gen_.Type = "[[gnu::visibility(\"hidden\")]]";
+
+    for (auto* Dir : {&Options_.CacheDir, &Options_.EmitDir, &Options_.LayoutDir}) {
+        if (Dir->empty())
+            continue;
+        if (auto EC{sys::fs::create_directories(*Dir)}) {
+            auto& Diags{CI.getDiagnostics()};
+            Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Error, "refl: cannot create directory '%0': %1"))
+                << *Dir << EC.message();
+            return false;
+        }
+    }
+
+    if (!Options_.CacheDir.empty())
+        Cache_ = std::make_unique<ReflCache>(Options_.CacheDir);
+
+    if (!Options_.EmitDir.empty() || !Options_.LayoutDir.empty()) {
+        SmallString<256> Root{Options_.EmitRoot};
+        if (auto EC{sys::fs::make_absolute(Root)}) {
+            auto& Diags{CI.getDiagnostics()};
+            Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Error, "refl: invalid emit root '%0': %1"))
+                << Options_.EmitRoot << EC.message();
+            return false;
+        }
+        sys::path::remove_dots(Root, true);
+        Options_.EmitRoot = Root.str().str();
+    }
+
+    // the main action has to exist before the source file is set up, its
+    // translation unit kind decides how the preprocessor is created
+    if (Options_.Inject || !Options_.EmitDir.empty()) {
+        auto Action{createProgramAction(Options_.EmitOnly ? frontend::ParseSyntaxOnly : getProgramAction(CI))};
+        if (!Action) {
+            reportUnsupportedAction(CI.getDiagnostics());
+            return false;
+        }
+        MainAction_ = std::make_unique<ReflMainAction>(std::move(Action));
+    }
+    return true;
+}
+
+// the build system expects the output of the command line, an empty file
+// keeps the step up to date without generating code
+void ReflectAction::writeEmptyOutput()
+{
+    auto& Diags{CI_->getDiagnostics()};
+    const auto& Output{CI_->getFrontendOpts().OutputFile};
+    if (Output.empty() || Output == "-" || Diags.hasErrorOccurred())
+        return;
+
+    if (auto Err{writeToOutput(Output, [](raw_ostream&) { return Error::success(); })}) {
+        Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Error, "refl: cannot write '%0': %1"))
+            << Output << toString(std::move(Err));
+    }
+}
+
+void ReflectAction::recompile()
+{
+    RewrittenFiles Files;
+    {
+        ReflTimer Timer{Stats_.RewriteTime, "refl rewrite"};
+        auto& SourceManager{CI_->getSourceManager()};
+        for (auto it = FileRewriter_.buffer_begin(); it != FileRewriter_.buffer_end(); ++it) {
+            auto Entry{SourceManager.getFileEntryRefForID(it->first)};
+            if (!Entry)
+                continue;
+            Files.emplace_back(Entry->getName().str(), std::string{it->second.begin(), it->second.end()});
+        }
+    }
+
+    ReflTimer Timer{Stats_.RecompileTime, "refl recompile"};
+    compile(CI_, Files);
+}
+
+void ReflectAction::reportStats()
+{
+    auto& Diags{CI_->getDiagnostics()};
+    auto Milliseconds = [](double Seconds) { return formatv("{0:f1}", Seconds * 1000).str(); };
+
+    Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Remark, "refl: %0 records and %1 enums reflected, %2 bytes of metadata generated"))
+        << Stats_.Records << Stats_.Enums << static_cast<unsigned>(Stats_.Bytes);
+    Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Remark, "refl: traversal %0 ms, generation %1 ms, rewrite %2 ms, recompile %3 ms"))
+        << Milliseconds(Stats_.TraversalTime) << Milliseconds(Stats_.GenerationTime)
+        << Milliseconds(Stats_.RewriteTime) << Milliseconds(Stats_.RecompileTime);
+    if (Stats_.LargestBytes > 0) {
+        Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Remark, "refl: largest metadata: '%0' with %1 bytes"))
+            << Stats_.LargestName << static_cast<unsigned>(Stats_.LargestBytes);
+    }
+    if (Cache_) {
+        Diags.Report(Diags.getCustomDiagID(DiagnosticsEngine::Remark, "refl: metadata cache: %0 hits, %1 misses"))
+            << Cache_->hits() << Cache_->misses();
+    }
+}
+
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wglobal-constructors"
 
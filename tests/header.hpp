@@ -0,0 +1,38 @@
+#pragma once
+
+#include <refl/refl.hpp>
+#include <string>
+
+namespace n2 {
+
+class [[refl::all]] InHeader {
+    int privateMember = 1;
+
+public:
+    std::string publicMember;
+    static inline int staticMember = 3;
+
+    int getMember() const { return privateMember; }
+};
+
+enum class [[refl::all]] HeaderEnum {
+    eFirst,
+    eSecond
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+
+struct [[refl::data]] HeaderFlags {
+    unsigned ready : 1;
+    unsigned mode : 3;
+};
+
+#pragma clang diagnostic pop
+
+// the accessor of HeaderFlags::mode as test_header.cpp sees it, the metadata
+// of a header is the same in every translation unit including it
+using HeaderFlagsGetter = unsigned (*)(const HeaderFlags&);
+HeaderFlagsGetter headerFlagsModeGetter();
+
+} // namespace n2
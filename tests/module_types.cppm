@@ -0,0 +1,20 @@
+module;
+#include <string>
+export module refl_test_types;
+import refl;
+
+export namespace n3 {
+
+struct [[refl::all]] InModule {
+    int id;
+    std::string label;
+
+    int twice() const { return id * 2; }
+};
+
+enum class [[refl::all]] ModuleEnum {
+    eFirst,
+    eSecond
+};
+
+} // namespace n3
@@ -0,0 +1,18 @@
+#include <refl/refl.hpp>
+#include <tuple>
+
+struct [[refl::data]] Point {
+    int x;
+    int y;
+};
+
+// the assertion only holds once the metadata of Point is generated
+int reflectedSum(const Point& p)
+{
+    int sum{};
+    refl::with<Point>([&]<class M>() {
+        static_assert(std::tuple_size_v<typename M::variables> == 2);
+        refl::for_each_variable<M>([&]<class V>() { sum += p.*V::ptr; });
+    });
+    return sum;
+}
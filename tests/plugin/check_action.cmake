@@ -0,0 +1,31 @@
+# Runs the plugin on actions.cpp with the frontend action selected by FLAGS,
+# in the mode selected by MODE, and checks that OUTPUT, when given, contains
+# the function using the reflected metadata.
+separate_arguments(FLAGS)
+set(plugin_args)
+if (MODE)
+    set(plugin_args "-fplugin-arg-reflect-${MODE}")
+endif()
+set(output_args)
+if (OUTPUT)
+    file(REMOVE "${OUTPUT}")
+    set(output_args -o "${OUTPUT}")
+endif()
+execute_process(
+    COMMAND "${COMPILER}" -std=c++23 ${FLAGS} "-I${INCLUDE}" "-fplugin=${PLUGIN}" ${plugin_args}
+            ${output_args} "${ROOT}/plugin/actions.cpp"
+    RESULT_VARIABLE result
+    ERROR_VARIABLE output)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "the compilation with '${FLAGS}' failed:\n${output}")
+endif()
+
+if (OUTPUT)
+    if (NOT EXISTS "${OUTPUT}")
+        message(FATAL_ERROR "${OUTPUT} was not written")
+    endif()
+    file(READ "${OUTPUT}" content)
+    if (NOT content MATCHES "_Z12reflectedSumRK5Point")
+        message(FATAL_ERROR "${OUTPUT} does not define reflectedSum")
+    endif()
+endif()
@@ -0,0 +1,43 @@
+# Runs the plugin with layout-report= on padded.cpp and checks the warning
+# about its padding and the offsets of the JSON report, which is named by
+# the path of the source relative to ROOT.
+file(REMOVE_RECURSE "${OUT}")
+execute_process(
+    COMMAND "${COMPILER}" -std=c++23 -fsyntax-only "-I${INCLUDE}" "-fplugin=${PLUGIN}"
+            "-fplugin-arg-reflect-layout-report=${OUT}" "-fplugin-arg-reflect-emit-root=${ROOT}"
+            "${ROOT}/plugin/padded.cpp"
+    RESULT_VARIABLE result
+    ERROR_VARIABLE output)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "the compilation failed:\n${output}")
+endif()
+if (NOT output MATCHES "'Padded' has 14 bytes of padding, ordering its fields as 'b, a, c' makes it 16 bytes instead of 24")
+    message(FATAL_ERROR "the padding of Padded was not reported:\n${output}")
+endif()
+
+set(report "${OUT}/plugin/padded.cpp.layout.json")
+if (NOT EXISTS "${report}")
+    message(FATAL_ERROR "${report} was not written")
+endif()
+file(READ "${report}" json)
+
+string(JSON name GET "${json}" records 0 name)
+string(JSON size GET "${json}" records 0 size)
+string(JSON padding GET "${json}" records 0 padding)
+string(JSON proposed GET "${json}" records 0 proposed size)
+if (NOT name STREQUAL "Padded" OR NOT size EQUAL 24 OR NOT padding EQUAL 14 OR NOT proposed EQUAL 16)
+    message(FATAL_ERROR "unexpected layout of Padded:\n${json}")
+endif()
+
+set(index 0)
+foreach (expected IN ITEMS "a:0" "b:8" "c:16")
+    string(REPLACE ":" ";" expected "${expected}")
+    list(GET expected 0 field)
+    list(GET expected 1 offset)
+    string(JSON actual_field GET "${json}" records 0 fields ${index} name)
+    string(JSON actual_offset GET "${json}" records 0 fields ${index} offset)
+    if (NOT actual_field STREQUAL field OR NOT actual_offset EQUAL offset)
+        message(FATAL_ERROR "expected '${field}' at offset ${offset}, found '${actual_field}' at ${actual_offset}")
+    endif()
+    math(EXPR index "${index} + 1")
+endforeach()
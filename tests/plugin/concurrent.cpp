@@ -0,0 +1,8 @@
+#include <atomic>
+#include <refl/refl.hpp>
+
+// written by different threads, but on the same cache line
+struct [[refl::data]] Shared {
+    __attribute__((refl_tag(refl::concurrent{}))) std::atomic<long> produced;
+    __attribute__((refl_tag(refl::concurrent{}))) std::atomic<long> consumed;
+};
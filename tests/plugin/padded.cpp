@@ -0,0 +1,8 @@
+#include <refl/refl.hpp>
+
+// 14 bytes of padding, ordering the fields as b, a, c makes it 16 bytes
+struct [[refl::data]] Padded {
+    char a;
+    double b;
+    char c;
+};
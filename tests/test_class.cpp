@@ -1,6 +1,10 @@
 #include <catch2/catch_test_macros.hpp>
+#include <cstddef>
+#include <refl/profile.hpp>
 #include <refl/refl.hpp>
 
+#include "header.hpp"
+
 struct NotReflected {
     int val;
 };
@@ -257,6 +261,19 @@ TEST_CASE("Testing templates", "[template]")
     CHECK(reflected == true);
 }
 
+TEST_CASE("Template instantiations share the metadata not depending on the arguments", "[template]")
+{
+    refl::with<TemplateTest<int>, TemplateTest<double>>([]<typename M1, typename M2>() {
+        CHECK(std::is_same_v<typename M1::info, typename M2::info>);
+        CHECK(!std::is_same_v<typename M1::functions, typename M2::functions>);
+
+        using F1 = std::tuple_element_t<0, typename M1::functions>;
+        using F2 = std::tuple_element_t<0, typename M2::functions>;
+        CHECK(std::is_same_v<typename F1::info, typename F2::info>);
+        CHECK(F1::name == F2::name);
+    });
+}
+
 struct [[refl::all]] Constructors {
     Constructors() {}
     Constructors(const Constructors&) {}
@@ -384,6 +401,350 @@ TEST_CASE("Attribute testing", "[attributes]")
     });
 }
 
+TEST_CASE("Name hashes", "[name_hash]")
+{
+    // FNV-1a test vectors
+    CHECK(refl::hash_name("") == 0xcbf29ce484222325);
+    CHECK(refl::hash_name("a") == 0xaf63dc4c8601ec8c);
+    CHECK(refl::hash_name("foobar") == 0x85944171f73967e8);
+
+    refl::with<Tags>([]<typename M>() {
+        CHECK(M::name_hash == refl::hash_name("Tags"));
+        refl::for_each_variable<M>([]<typename V>() {
+            CHECK(V::name_hash == refl::hash_name(V::name));
+        });
+        refl::for_each_function<M>([]<typename F>() {
+            CHECK(F::name_hash == refl::hash_name("foo"));
+        });
+    });
+}
+
+struct NotTrivial {
+    NotTrivial() = default;
+    NotTrivial(const NotTrivial&) {}
+    int i;
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+
+struct [[refl::data]] Layout {
+    char a;
+    int b, c;
+    NotTrivial d;
+    double e;
+    char f;
+    static inline int g = 0;
+};
+
+#pragma clang diagnostic pop
+
+TEST_CASE("Record layout", "[layout]")
+{
+    refl::with<Layout>([]<typename M>() {
+        CHECK(M::size == sizeof(Layout));
+        CHECK(M::alignment == alignof(Layout));
+        refl::for_each_variable<M>([]<typename V>() {
+            if constexpr (V::name == "b") {
+                CHECK(V::offset == offsetof(Layout, b));
+                CHECK(V::size == sizeof(int));
+                CHECK(V::alignment == alignof(int));
+            } else if constexpr (V::name == "g") {
+                CHECK(V::offset == refl::no_offset);
+            }
+        });
+
+        constexpr auto padding = sizeof(Layout) - 1 - 2 * sizeof(int) - sizeof(NotTrivial) - sizeof(double) - 1;
+        CHECK(M::padding() == padding);
+
+        constexpr auto runs = M::trivially_copyable_runs();
+        REQUIRE(runs.size() == 3);
+        CHECK(runs[0].offset == offsetof(Layout, a));
+        CHECK(runs[0].size == 1);
+        CHECK(runs[1].offset == offsetof(Layout, b));
+        CHECK(runs[1].size == 2 * sizeof(int));
+        CHECK(runs[2].offset == offsetof(Layout, e));
+        CHECK(runs[2].size == sizeof(double) + 1);
+    });
+}
+
+// not reflected, but known to be relocatable
+struct Owner {
+    Owner() = default;
+    Owner(Owner&&) noexcept {}
+    ~Owner() {}
+};
+
+template <>
+struct refl::is_trivially_relocatable<Owner> : std::true_type {};
+
+struct [[refl::all]] Traits {
+    int i = 0;
+    Owner o;
+    Traits() = default;
+    Traits(Traits&&) = default;
+    Traits(int, int) {}
+    int get() const noexcept { return i; }
+    constexpr int twice(int x) { return 2 * x; }
+    void set(int x) noexcept(sizeof(int) == 4) { i = x; }
+};
+
+template <typename T>
+struct [[refl::all]] Wrapper {
+    T value;
+    T make() const noexcept(std::is_nothrow_default_constructible_v<T>) { return T{}; }
+};
+
+struct [[refl::data]] Buffer {
+    Traits t[2];
+    int* data;
+};
+
+struct [[refl::data]] Strict {
+    Buffer b;
+    ~Strict() {}
+};
+
+TEST_CASE("Function and constructor traits", "[traits]")
+{
+    refl::with<Traits>([]<typename M>() {
+        refl::for_each_function<M>([]<typename F>() {
+            if constexpr (F::name == "get") {
+                CHECK(F::is_const);
+                CHECK(F::is_noexcept);
+                CHECK_FALSE(F::is_constexpr);
+            } else if constexpr (F::name == "twice") {
+                CHECK_FALSE(F::is_const);
+                CHECK_FALSE(F::is_noexcept);
+                CHECK(F::is_constexpr);
+            } else if constexpr (F::name == "set") {
+                CHECK(F::is_noexcept == (sizeof(int) == 4));
+            }
+        });
+        refl::for_each_constructor<M>([]<typename C>() {
+            if constexpr (C::is_move_copy()) {
+                CHECK(C::is_noexcept());
+                CHECK_FALSE(C::is_trivial());
+            } else if constexpr (!C::is_default()) {
+                CHECK_FALSE(C::is_noexcept());
+            }
+        });
+    });
+
+    // the noexcept of a class template depends on its arguments
+    refl::with<Wrapper<int>, Wrapper<Constructors>>([]<typename M1, typename M2>() {
+        refl::for_each_function<M1>([]<typename F>() { CHECK(F::is_noexcept); });
+        refl::for_each_function<M2>([]<typename F>() { CHECK_FALSE(F::is_noexcept); });
+    });
+}
+
+TEST_CASE("Trivial relocation", "[traits]")
+{
+    CHECK(refl::is_trivially_relocatable_v<int[4]>);
+    CHECK_FALSE(refl::is_trivially_relocatable_v<NotTrivial>);
+    CHECK(refl::is_trivially_relocatable_v<Traits>);
+    CHECK(refl::is_trivially_relocatable_v<Buffer>);
+    CHECK_FALSE(refl::is_trivially_relocatable_v<Strict>);
+}
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+
+struct [[refl::data]] Packed {
+    unsigned version : 4;
+    unsigned type : 4;
+    unsigned short length;
+    int : 8;
+    signed delta : 5;
+    bool last : 1;
+};
+
+#pragma clang diagnostic pop
+
+TEST_CASE("Bit-fields", "[layout]")
+{
+    Packed p{};
+    refl::with<Packed>([&]<typename M>() {
+        // unnamed bit-fields are not reflected
+        CHECK(std::tuple_size_v<typename M::variables> == 5);
+        refl::for_each_variable<M>([&]<typename V>() {
+            if constexpr (V::name == "type") {
+                CHECK(V::is_bit_field);
+                CHECK(V::width == 4);
+                CHECK(V::bit_offset == 4);
+                CHECK(V::offset == 0);
+                CHECK(V::size == 1);
+                V::set(p, 9);
+            } else if constexpr (V::name == "delta") {
+                V::set(p, -3);
+                CHECK(V::get(p) == -3);
+            } else if constexpr (V::name == "length") {
+                CHECK_FALSE(V::is_bit_field);
+                V::set(p, 512);
+            }
+        });
+
+        // the bit-fields sharing the first byte form a single run, the
+        // unnamed bit-field splits the rest
+        constexpr auto runs = M::trivially_copyable_runs();
+        REQUIRE(runs.size() == 3);
+        CHECK(runs[0].offset == 0);
+        CHECK(runs[0].size == 1);
+        CHECK(runs[1].offset == offsetof(Packed, length));
+        CHECK(runs[2].offset == 5);
+    });
+    CHECK(p.type == 9);
+    CHECK(p.delta == -3);
+    CHECK(p.length == 512);
+}
+
+TEST_CASE("Bit-fields of a header are accessed the same in every translation unit", "[layout]")
+{
+    n2::HeaderFlags flags{};
+    n2::HeaderFlagsGetter getter = nullptr;
+    refl::with<n2::HeaderFlags>([&]<typename M>() {
+        refl::for_each_variable<M>([&]<typename V>() {
+            if constexpr (V::name == "mode") {
+                V::set(flags, 5);
+                getter = &V::get;
+            }
+        });
+    });
+    REQUIRE(getter != nullptr);
+    CHECK(getter == n2::headerFlagsModeGetter());
+    CHECK(flags.mode == 5);
+    CHECK(n2::headerFlagsModeGetter()(flags) == 5);
+}
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+
+// each of them on its own cache line, as the plugin proposes
+struct [[refl::data]] Counters {
+    __attribute__((refl_tag(refl::concurrent{}))) long produced alignas(64);
+    __attribute__((refl_tag(refl::concurrent{}))) long consumed alignas(64);
+    long capacity alignas(64);
+};
+
+#pragma clang diagnostic pop
+
+TEST_CASE("Concurrently written variables", "[layout]")
+{
+    refl::with<Counters>([]<typename M>() {
+        int tagged = 0;
+        refl::for_each_variable<M>([&]<typename V>() {
+            if constexpr (refl::has_tag<V, refl::concurrent>) {
+                tagged++;
+                CHECK(V::offset % 64 == 0);
+            }
+        });
+        CHECK(tagged == 2);
+    });
+}
+
+struct [[refl::data]] Data : Tag {
+    int a, b;
+    [[refl::include]] void foo() {}
+    void bar() {}
+    Data() = default;
+};
+
+struct __attribute__((refl_only("functions, constructors"))) Only : Tag {
+    int a;
+    void foo() {}
+    Only() = default;
+};
+
+TEST_CASE("Reflecting only some member categories", "[attributes]")
+{
+    refl::with<Data>([]<typename M>() {
+        CHECK(std::tuple_size_v<typename M::base_classes> == 1);
+        CHECK(std::tuple_size_v<typename M::variables> == 2);
+        CHECK(std::tuple_size_v<typename M::functions> == 1);
+        CHECK(std::tuple_size_v<typename M::constructors> == 0);
+    });
+
+    refl::with<Only>([]<typename M>() {
+        CHECK(std::tuple_size_v<typename M::base_classes> == 0);
+        CHECK(std::tuple_size_v<typename M::variables> == 0);
+        CHECK(std::tuple_size_v<typename M::functions> == 1);
+        CHECK(std::tuple_size_v<typename M::constructors> == 1);
+    });
+}
+
+struct [[refl::closed]] Shape {
+    virtual ~Shape() = default;
+    virtual int sides() const = 0;
+};
+
+struct Polygon : Shape {
+    int sides() const override { return 0; }
+};
+
+struct Circle : Shape {
+    int sides() const override { return 0; }
+};
+
+struct Triangle final : Polygon {
+    int sides() const override { return 3; }
+};
+
+TEST_CASE("Closed hierarchies", "[closed]")
+{
+    CHECK(refl::hierarchy<Shape>::id == 0);
+    CHECK(refl::hierarchy<Shape>::last == 3);
+    CHECK(refl::hierarchy<Polygon>::id == 1);
+    CHECK(refl::hierarchy<Triangle>::id == 2);
+    CHECK(refl::hierarchy<Circle>::id == 3);
+    CHECK(std::is_same_v<refl::hierarchy<Polygon>::derived, refl::detail::list<Triangle>>);
+    CHECK(std::tuple_size_v<refl::hierarchy<Shape>::types> == 4);
+
+    Triangle triangle;
+    Circle circle;
+    const Shape& shape = triangle;
+    CHECK(refl::type_id(shape) == 2);
+    CHECK(refl::isa<Polygon>(shape));
+    CHECK(refl::isa<Triangle>(shape));
+    CHECK_FALSE(refl::isa<Circle>(shape));
+    CHECK(refl::dyn_cast<Polygon>(&shape) == &triangle);
+    CHECK(refl::dyn_cast<Circle>(&shape) == nullptr);
+
+    Shape* shapes[] = {&triangle, &circle};
+    int sides       = 0;
+    for (auto* it : shapes) {
+        sides += refl::visit_derived(*it, []<typename T>(T& derived) {
+            if constexpr (std::is_same_v<T, Triangle>) return derived.Triangle::sides();
+            else return 0;
+        });
+    }
+    CHECK(sides == 3);
+}
+
+struct [[refl::all]] Profiled {
+    __attribute__((refl_tag(refl::profile{}))) int twice(int x) { return 2 * x; }
+    int thrice(int x) { return 3 * x; }
+};
+
+TEST_CASE("Profiling tagged functions", "[profile]")
+{
+    Profiled p;
+    int sum = 0;
+    refl::with<Profiled>([&]<typename M>() {
+        refl::for_each_function<M>([&]<typename F>() {
+            for (int i = 0; i != 10; ++i) sum += refl::instrumented<F>{}(p, i);
+        });
+    });
+    CHECK(sum == 5 * 45);
+
+    // only the tagged function is profiled
+    auto results = refl::profile::snapshot();
+    auto found   = std::find_if(results.begin(), results.end(), [](const auto& r) { return r.name.starts_with("Profiled::"); });
+    REQUIRE(found != results.end());
+    CHECK(found->name == "Profiled::twice(int)");
+    CHECK(found->count == 10);
+    CHECK(std::none_of(results.begin(), results.end(), [](const auto& r) { return r.name.starts_with("Profiled::thrice"); }));
+}
+
 struct [[refl::all]] Operators {
     Operators& operator=(const Operators&) { return *this; }
     Operators& operator-=(const Operators&) { return *this; }
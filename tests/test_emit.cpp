@@ -0,0 +1,74 @@
+#include <catch2/catch_test_macros.hpp>
+#include <refl/refl.hpp>
+#include <string>
+
+namespace n3 {
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+
+// only the public members can be reflected in emit mode
+class [[refl::all]] Emitted {
+    [[refl::exclude]] int hidden = 4;
+
+public:
+    int member = 4;
+    std::string publicMember;
+    unsigned flags : 3 = 2;
+    static inline int staticMember = 5;
+
+    int twice(int v) const { return 2 * v; }
+    int hiddenValue() const { return hidden; }
+
+    struct [[refl::all]] Inner {
+        bool flag;
+    };
+};
+
+#pragma clang diagnostic pop
+
+enum class [[refl::all]] EmittedEnum {
+    eFirst,
+    eSecond
+};
+
+} // namespace n3
+
+// compiled without the plugin, the metadata is written by the tests_emit_refl_emit target
+#if __has_include("test_emit.cpp.refl.hpp") && !defined(REFL_EMIT)
+    #include "test_emit.cpp.refl.hpp"
+#endif
+
+TEST_CASE("Reflection from emitted headers is tested", "[emit]")
+{
+#ifndef REFL_EMIT
+    n3::Emitted e;
+    bool called = false;
+    refl::with<n3::Emitted>([&]<class M>() {
+        CHECK(M::name == "Emitted");
+        CHECK(M::qualified_name == "n3::Emitted");
+        CHECK(std::tuple_size_v<typename M::variables> == 4);
+        CHECK(std::tuple_size_v<typename M::functions> == 2);
+
+        using V = std::tuple_element_t<0, typename M::variables>;
+        CHECK(V::name == "member");
+        CHECK(V::access == refl::AccessSpecifier::Public);
+        CHECK(e.*V::ptr == 4);
+
+        using B = std::tuple_element_t<2, typename M::variables>;
+        CHECK(B::is_bit_field);
+        CHECK(B::get(e) == 2);
+
+        using S = std::tuple_element_t<3, typename M::variables>;
+        CHECK(*S::ptr == 5);
+
+        using F = std::tuple_element_t<0, typename M::functions>;
+        CHECK((e.*F::ptr)(3) == 6);
+        called = true;
+    });
+    CHECK(called);
+
+    CHECK(refl::reflected<n3::Emitted::Inner>);
+    CHECK(refl::e::to_string(n3::EmittedEnum::eSecond) == "eSecond");
+#endif
+}
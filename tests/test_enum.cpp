@@ -54,6 +54,11 @@ TEST_CASE("Reflection of scoped enum is tested", "[scoped_enum]")
         CHECK(enums["eVal1"] == ScopedEnum::eVal1);
         CHECK(enums["eVal2"] == ScopedEnum::eVal2);
         CHECK(enums["eVal3"] == ScopedEnum::eVal3);
+
+        CHECK(E::name_hash == refl::hash_name("ScopedEnum"));
+        for (auto e : E::enumerators) {
+            CHECK(e.name_hash == refl::hash_name(e.name));
+        }
         called = true;
     });
     CHECK(called == true);
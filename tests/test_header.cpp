@@ -0,0 +1,47 @@
+#include <catch2/catch_test_macros.hpp>
+#include <refl/refl.hpp>
+
+#include "header.hpp"
+
+struct [[refl::all]] InSource {
+    n2::InHeader member;
+};
+
+n2::HeaderFlagsGetter n2::headerFlagsModeGetter()
+{
+    HeaderFlagsGetter getter = nullptr;
+    refl::with<HeaderFlags>([&getter]<class M>() {
+        refl::for_each_variable<M>([&getter]<class V>() {
+            if constexpr (V::name == "mode")
+                getter = &V::get;
+        });
+    });
+    return getter;
+}
+
+TEST_CASE("Reflection of types declared in a header is tested", "[header]")
+{
+    bool called = false;
+    refl::with<n2::InHeader>([&called]<class M>() {
+        CHECK(M::name == "InHeader");
+        CHECK(M::qualified_name == "n2::InHeader");
+        CHECK(std::tuple_size_v<typename M::variables> == 3);
+        CHECK(std::tuple_size_v<typename M::functions> == 1);
+        called = true;
+    });
+    CHECK(called);
+
+    CHECK(refl::e::to_string(n2::HeaderEnum::eSecond) == "eSecond");
+    CHECK(refl::e::from_string<n2::HeaderEnum>("eFirst") == n2::HeaderEnum::eFirst);
+}
+
+TEST_CASE("Reflection of the main file is kept next to a reflected header", "[header]")
+{
+    bool called = false;
+    refl::with<InSource>([&called]<class M>() {
+        CHECK(M::name == "InSource");
+        CHECK(std::tuple_size_v<typename M::variables> == 1);
+        called = true;
+    });
+    CHECK(called);
+}
@@ -0,0 +1,84 @@
+#include <catch2/catch_test_macros.hpp>
+#include <map>
+#include <refl/refl.hpp>
+
+// compiled with -fplugin-arg-reflect-inject, the metadata is declared next to
+// the types instead of inside of them
+
+namespace n1 {
+
+class [[refl::all]] Injected {
+    int privateMember = 5;
+
+public:
+    inline static int staticMember = 7;
+    int publicMember               = 42;
+    int getMember() const
+    {
+        return privateMember;
+    }
+
+    struct [[refl::all]] Inner {
+        int value = 1;
+    };
+
+    enum class [[refl::all]] InnerEnum {
+        eVal1,
+        eVal2
+    };
+};
+
+enum class [[refl::all]] NamespaceEnum {
+    eVal1 = 3,
+    eVal2 = 5
+};
+
+} // namespace n1
+
+TEST_CASE("Testing injected records", "[inject]")
+{
+    n1::Injected i;
+    std::map<std::string_view, int> values;
+    bool called = false;
+    refl::with<n1::Injected>([&]<class M>() {
+        CHECK(M::name == "Injected");
+        CHECK(M::qualified_name == "n1::Injected");
+
+        refl::for_each_variable<M>([&]<class V>() {
+            if constexpr (V::is_instance()) {
+                values[V::name] = i.*V::ptr;
+            } else {
+                values[V::name] = *V::ptr;
+            }
+        });
+
+        refl::for_each_function<M>([&]<class F>() {
+            if constexpr (F::name == "getMember") {
+                CHECK((i.*F::ptr)() == 5);
+                called = true;
+            }
+        });
+    });
+
+    CHECK(called == true);
+    CHECK(values.size() == 3);
+    CHECK(values["privateMember"] == 5);
+    CHECK(values["publicMember"] == 42);
+    CHECK(values["staticMember"] == 7);
+
+    called = false;
+    refl::with<n1::Injected::Inner>([&]<class M>() {
+        CHECK(M::qualified_name == "n1::Injected::Inner");
+        called = true;
+    });
+    CHECK(called == true);
+}
+
+TEST_CASE("Testing injected enums", "[inject]")
+{
+    CHECK(refl::e::from_string<n1::NamespaceEnum>("eVal2") == n1::NamespaceEnum::eVal2);
+    CHECK(refl::e::to_string(n1::NamespaceEnum::eVal1) == "eVal1");
+
+    CHECK(refl::e::to_string(n1::Injected::InnerEnum::eVal2) == "eVal2");
+    CHECK(refl::e::valid(n1::Injected::InnerEnum::eVal1));
+}
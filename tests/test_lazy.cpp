@@ -0,0 +1,56 @@
+#include <catch2/catch_test_macros.hpp>
+#include <refl/refl.hpp>
+#include <type_traits>
+#include <vector>
+
+struct [[refl::all]] LazyMember {
+    int value;
+};
+
+struct [[refl::all]] LazyBase {
+    int baseValue;
+};
+
+struct [[refl::all]] LazyUsed : LazyBase {
+    std::vector<LazyMember> members;
+};
+
+struct [[refl::all]] LazyUnused {
+    int value;
+};
+
+enum class [[refl::all]] LazyEnum {
+    eFirst,
+    eSecond
+};
+
+// true when the plugin generated a stub instead of the metadata
+template <typename T> struct stubbed : std::false_type {};
+template <typename T>
+    requires std::is_same_v<typename T::_meta, refl::detail::lazy<T>>
+struct stubbed<T> : std::true_type {};
+
+TEST_CASE("Lazy generation of reflection is tested", "[lazy]")
+{
+    int bases   = 0;
+    bool called = false;
+    refl::with<LazyUsed>([&]<class M>() {
+        CHECK(M::name == "LazyUsed");
+        // only reached through the metadata of LazyUsed
+        CHECK(refl::reflected<LazyMember>);
+        refl::for_each_base_class<M>([&]<typename B>() {
+            refl::with<typename B::type>([&]<class BM>() {
+                CHECK(BM::name == "LazyBase");
+                bases++;
+            });
+        });
+        called = true;
+    });
+    CHECK(called);
+    CHECK(bases == 1);
+
+    CHECK(refl::e::to_string(LazyEnum::eSecond) == "eSecond");
+
+    CHECK(stubbed<LazyUnused>::value);
+    CHECK_FALSE(stubbed<LazyUsed>::value);
+}
@@ -0,0 +1,43 @@
+#include <catch2/catch_test_macros.hpp>
+#include <tuple>
+import refl;
+import refl_test_types;
+
+struct [[refl::all]] ModuleLocal {
+    int value;
+};
+
+TEST_CASE("Reflection of types exported from a module is tested", "[module]")
+{
+    // the metadata was generated when the module was built
+    int count = 0;
+    refl::with<n3::InModule>([&]<class M>() {
+        CHECK(M::name == "InModule");
+        CHECK(M::qualified_name == "n3::InModule");
+        refl::for_each_variable<M>([&]<class V>() { count++; });
+        refl::for_each_function<M>([&]<class F>() { CHECK(F::name == "twice"); });
+    });
+    CHECK(count == 2);
+
+    CHECK(refl::e::to_string(n3::ModuleEnum::eSecond) == "eSecond");
+    CHECK(refl::e::from_string<n3::ModuleEnum>("eFirst") == n3::ModuleEnum::eFirst);
+}
+
+TEST_CASE("Reflection of types importing the refl module is tested", "[module]")
+{
+    bool called = false;
+    refl::with<ModuleLocal>([&]<class M>() {
+        CHECK(M::name == "ModuleLocal");
+        called = true;
+    });
+    CHECK(called);
+}
+
+TEST_CASE("The metadata lists of an imported refl support std::tuple_size", "[module]")
+{
+    // the specializations for type_list are not exported, but reachable
+    refl::with<n3::InModule>([]<class M>() {
+        CHECK(std::tuple_size_v<typename M::variables> == 2);
+        CHECK(std::tuple_element_t<0, typename M::variables>::name == "id");
+    });
+}